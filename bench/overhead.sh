@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# SPDX-FileCopyrightText: 2020 Sveriges Television AB
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+# Measures the per frame cost of the proxy itself by running the reference
+# plugins through ffmpeg -benchmark next to graphs without the proxy.
+#
+# usage: bench/overhead.sh [frames]
+#
+# FFMPEG and CC may be set to pick the ffmpeg build (with vf_proxy) and
+# compiler to use.
+
+set -e
+
+FFMPEG=${FFMPEG:-ffmpeg}
+CC=${CC:-cc}
+FRAMES=${1:-500}
+DIR=$(cd "$(dirname "$0")" && pwd)
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+for plugin in null fill rect; do
+  $CC -O2 -shared -fPIC -o "$OUT/$plugin.so" "$DIR/plugins/$plugin.c" -lm
+done
+
+run() {
+  name=$1
+  graph=$2
+  "$FFMPEG" -hide_banner -nostats -benchmark \
+    -f lavfi -i "testsrc2=size=$size:rate=50,format=bgra" \
+    -filter_complex "$graph" -frames:v "$FRAMES" -f null - 2>&1 |
+    sed -n "s/^bench: \(.*\)/$size $name \1/p"
+}
+
+for size in 1920x1080 3840x2160; do
+  run null "null"
+  run proxy-null "proxy=filter_path=$OUT/null.so"
+  run proxy-null-clear "proxy=filter_path=$OUT/null.so:clear=1"
+  run proxy-fill "proxy=filter_path=$OUT/fill.so"
+  run proxy-rect-clear "proxy=filter_path=$OUT/rect.so:clear=1"
+  run split-overlay-null \
+    "split[main][over];[over]null[ovl];[main][ovl]overlay=format=auto"
+  run split-overlay-rect \
+    "split[main][over];[over]proxy=filter_path=$OUT/rect.so:clear=1[ovl];[main][ovl]overlay=format=auto"
+done
@@ -0,0 +1,38 @@
+/*
+ * SPDX-FileCopyrightText: 2020 Sveriges Television AB
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Fills the whole frame with a BGRA color given as 0xAARRGGBB in config.
+int filter_init(const char* config, void** user_data) {
+  uint32_t color = config && *config ? strtoul(config, NULL, 0) : 0x80ff0000;
+  *user_data = (void*)(uintptr_t)color;
+  return 0;
+}
+
+int filter_frame(unsigned char* data,
+                 unsigned int data_size,
+                 int width,
+                 int height,
+                 int line_size,
+                 double ts_millis,
+                 void* user_data) {
+  uint32_t color = (uint32_t)(uintptr_t)user_data;
+  uint8_t pixel[4] = {color, color >> 8, color >> 16, color >> 24};
+
+  for (int x = 0; x < width; x++) {
+    memcpy(data + x * 4, pixel, 4);
+  }
+  for (int y = 1; y < height; y++) {
+    memcpy(data + y * line_size, data, width * 4);
+  }
+
+  return 0;
+}
+
+void filter_uninit(void* user_data) {}
@@ -0,0 +1,22 @@
+/*
+ * SPDX-FileCopyrightText: 2020 Sveriges Television AB
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+int filter_init(const char* config, void** user_data) {
+  *user_data = 0;
+  return 0;
+}
+
+int filter_frame(unsigned char* data,
+                 unsigned int data_size,
+                 int width,
+                 int height,
+                 int line_size,
+                 double ts_millis,
+                 void* user_data) {
+  return 0;
+}
+
+void filter_uninit(void* user_data) {}
@@ -0,0 +1,43 @@
+/*
+ * SPDX-FileCopyrightText: 2020 Sveriges Television AB
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RECT_W 320
+#define RECT_H 180
+
+// Draws an opaque white rectangle bouncing across the frame, moving one frame
+// width per second.
+int filter_init(const char* config, void** user_data) {
+  *user_data = 0;
+  return 0;
+}
+
+int filter_frame(unsigned char* data,
+                 unsigned int data_size,
+                 int width,
+                 int height,
+                 int line_size,
+                 double ts_millis,
+                 void* user_data) {
+  int w = width < RECT_W ? width : RECT_W;
+  int h = height < RECT_H ? height : RECT_H;
+  double t = ts_millis / 1000;
+  double fx = fabs(fmod(t, 2) - 1);
+  double fy = fabs(fmod(t * 0.75, 2) - 1);
+  int x0 = (int)(fx * (width - w));
+  int y0 = (int)(fy * (height - h));
+
+  for (int y = y0; y < y0 + h; y++) {
+    memset(data + y * line_size + x0 * 4, 0xff, w * 4);
+  }
+
+  return 0;
+}
+
+void filter_uninit(void* user_data) {}
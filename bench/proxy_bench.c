@@ -0,0 +1,255 @@
+/*
+ * SPDX-FileCopyrightText: 2020 Sveriges Television AB
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRAME_UNCHANGED 0x454D4153
+
+enum { TS_LINEAR, TS_CONSTANT, TS_RANDOM };
+
+typedef struct {
+  int (*filter_init)(const char*, void**);
+  int (*filter_frame)(unsigned char*,
+                      unsigned int,
+                      int,
+                      int,
+                      int,
+                      double,
+                      void*);
+  void (*filter_uninit)(void*);
+} Filter;
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [options] <filter.so>\n"
+          "  -s WxH[,WxH...]  frame sizes (default 1920x1080)\n"
+          "  -r RATE          frame rate, e.g. 50 or 30000/1001 (default 25)\n"
+          "  -n FRAMES        frames to measure per size (default 500)\n"
+          "  -w FRAMES        warm-up frames per size (default 10)\n"
+          "  -t SEQUENCE      ts_millis sequence: linear, constant or random\n"
+          "  -c               clear the frame before each call\n"
+          "  -C CONFIG        config passed to filter_init\n",
+          name);
+}
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, int n, double p) {
+  int i = (int)(p * (n - 1) + 0.5);
+  return sorted[i];
+}
+
+static int load_symbol(void* handle, const char* name, void** sym) {
+  *sym = dlsym(handle, name);
+  if (!*sym) {
+    fprintf(stderr, "%s\n", dlerror());
+    return -1;
+  }
+
+  return 0;
+}
+
+static int run(const Filter* f,
+               const char* config,
+               int width,
+               int height,
+               double rate,
+               int nb_frames,
+               int nb_warmup,
+               int sequence,
+               int clear) {
+  int line_size = (width * 4 + 63) & ~63;
+  unsigned int data_size = (unsigned int)width * height * 4;
+  size_t buf_size = (size_t)line_size * height;
+  unsigned char* data = NULL;
+  double* samples = calloc(nb_frames, sizeof(*samples));
+  void* user_data = NULL;
+  int unchanged = 0;
+  int ret = -1;
+
+  if (!samples || posix_memalign((void**)&data, 64, buf_size)) {
+    fprintf(stderr, "out of memory\n");
+    goto fail;
+  }
+  memset(data, 0, buf_size);
+
+  int rc = f->filter_init(config, &user_data);
+  if (rc != 0) {
+    fprintf(stderr, "filter_init returned: %d\n", rc);
+    goto fail;
+  }
+
+  srand(1);
+  double start = 0;
+  for (int i = -nb_warmup; i < nb_frames; i++) {
+    if (i == 0) {
+      start = now_us();
+    }
+
+    int n = i + nb_warmup;
+    double ts_millis = n * 1000 / rate;
+    if (sequence == TS_CONSTANT) {
+      ts_millis = 0;
+    } else if (sequence == TS_RANDOM) {
+      ts_millis = (rand() % (3600 * (int)rate)) * 1000 / rate;
+    }
+
+    double t0 = now_us();
+    if (clear) {
+      memset(data, 0, buf_size);
+    }
+
+    rc = f->filter_frame(data, data_size, width, height, line_size, ts_millis,
+                         user_data);
+    double t1 = now_us();
+
+    if (rc == FRAME_UNCHANGED) {
+      unchanged += i >= 0;
+    } else if (rc != 0) {
+      fprintf(stderr, "filter_frame returned: %d\n", rc);
+      f->filter_uninit(user_data);
+      goto fail;
+    }
+
+    if (i >= 0) {
+      samples[i] = t1 - t0;
+    }
+  }
+  double elapsed = now_us() - start;
+
+  f->filter_uninit(user_data);
+
+  qsort(samples, nb_frames, sizeof(*samples), cmp_double);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%dx%d frames:%d unchanged:%d fps:%.1f p50:%.0fus p90:%.0fus "
+         "p99:%.0fus max:%.0fus peak_rss:%ldkB\n",
+         width, height, nb_frames, unchanged, nb_frames * 1e6 / elapsed,
+         percentile(samples, nb_frames, 0.5),
+         percentile(samples, nb_frames, 0.9),
+         percentile(samples, nb_frames, 0.99), samples[nb_frames - 1],
+         usage.ru_maxrss);
+  ret = 0;
+
+fail:
+  free(data);
+  free(samples);
+  return ret;
+}
+
+int main(int argc, char** argv) {
+  const char* sizes = "1920x1080";
+  const char* config = NULL;
+  double rate = 25;
+  int nb_frames = 500;
+  int nb_warmup = 10;
+  int sequence = TS_LINEAR;
+  int clear = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:r:n:w:t:cC:h")) != -1) {
+    switch (opt) {
+      case 's':
+        sizes = optarg;
+        break;
+      case 'r': {
+        int num, den;
+        if (sscanf(optarg, "%d/%d", &num, &den) == 2 && num > 0 && den > 0) {
+          rate = (double)num / den;
+        } else {
+          rate = atof(optarg);
+        }
+        break;
+      }
+      case 'n':
+        nb_frames = atoi(optarg);
+        break;
+      case 'w':
+        nb_warmup = atoi(optarg);
+        break;
+      case 't':
+        if (!strcmp(optarg, "linear")) {
+          sequence = TS_LINEAR;
+        } else if (!strcmp(optarg, "constant")) {
+          sequence = TS_CONSTANT;
+        } else if (!strcmp(optarg, "random")) {
+          sequence = TS_RANDOM;
+        } else {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'c':
+        clear = 1;
+        break;
+      case 'C':
+        config = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return opt != 'h';
+    }
+  }
+
+  if (optind != argc - 1 || rate <= 0 || nb_frames <= 0 || nb_warmup < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  void* handle = dlopen(argv[optind], RTLD_NOW);
+  if (!handle) {
+    fprintf(stderr, "%s\n", dlerror());
+    return 1;
+  }
+
+  Filter f;
+  if (load_symbol(handle, "filter_init", (void**)&f.filter_init) < 0 ||
+      load_symbol(handle, "filter_frame", (void**)&f.filter_frame) < 0 ||
+      load_symbol(handle, "filter_uninit", (void**)&f.filter_uninit) < 0) {
+    dlclose(handle);
+    return 1;
+  }
+
+  int ret = 0;
+  for (const char* p = sizes; *p && !ret;) {
+    int width, height, n;
+    if (sscanf(p, "%dx%d%n", &width, &height, &n) != 2 || width <= 0 ||
+        height <= 0) {
+      fprintf(stderr, "invalid size: %s\n", p);
+      ret = 1;
+      break;
+    }
+
+    ret = run(&f, config, width, height, rate, nb_frames, nb_warmup, sequence,
+              clear) < 0;
+    p += n;
+    if (*p == ',') {
+      p++;
+    }
+  }
+
+  dlclose(handle);
+  return ret;
+}
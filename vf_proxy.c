@@ -4,28 +4,323 @@
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <dlfcn.h>
+#include <linux/mempolicy.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "avfilter.h"
+#include "filters.h"
 #include "formats.h"
 #include "internal.h"
 #include "libavutil/avassert.h"
 #include "libavutil/avstring.h"
+#include "libavutil/hwcontext.h"
+#include "libavutil/hwcontext_drm.h"
 #include "libavutil/imgutils.h"
 #include "libavutil/intreadwrite.h"
+#include "libavutil/mathematics.h"
 #include "libavutil/opt.h"
 #include "libavutil/parseutils.h"
+#include "libavutil/pixdesc.h"
+#include "libavutil/time.h"
 #include "video.h"
 
+#define MAX_DEPTH 32
+#define MAX_RECTS 16
+#define RECEIVE_AGAIN 1
+#define FRAME_UNCHANGED MKTAG('S', 'A', 'M', 'E')
+#define DEADLINE_MISSED MKTAG('L', 'A', 'T', 'E')
+#define MAX_SLOTS 64
+#define MAX_OUTPUTS 8
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (32 << HIST_SUB_BITS)
+#define PROXY_HOST_VERSION 1
+#define HOST_POOLS 32
+#define HOST_MIN_ALLOC 64
+#define HOST_ALIGN 64
+#define HOST_LOG_RATE 10
+#define TRACE_BLOCK_EVENTS 1024
+#define TRACE_MAX_BLOCKS 1024
+#define PROXY_FRAME_VERSION 1
+#define PROXY_FRAME_WARMUP (1 << 0)
+#define PROXY_FRAME_PREDICTED (1 << 1)
+#define PROXY_CAP_FRAME2 (1 << 0)
+#define PROXY_CAP_ASYNC (1 << 1)
+#define PROXY_CAP_SLICES (1 << 2)
+#define PROXY_CAP_DAMAGE (1 << 3)
+#define PROXY_CAP_FORMATS (1 << 4)
+#define PROXY_CAP_PLANES (1 << 5)
+#define PROXY_CAP_HW (1 << 6)
+#define PROXY_CAP_OWNED (1 << 7)
+#define PROXY_CAP_BATCH (1 << 8)
+#define PROXY_CAP_RECONFIGURE (1 << 9)
+#define PROXY_CAP_STATELESS (1 << 10)
+#define PROXY_CAP_UNCHANGED (1 << 11)
+#define PROXY_CAP_THREAD_SAFE (1 << 12)
+
+enum { STAGE_WRITABLE, STAGE_CLEAR, STAGE_RENDER, STAGE_BLEND, STAGE_PUSH,
+       STAGE_SCALE, NB_STAGES };
+
+static const char* const stage_names[NB_STAGES] = {
+    "writable", "clear", "render", "blend", "push", "scale",
+};
+
+enum { TRACE_QUEUE = NB_STAGES };
+
+static const char* const stage_keys[NB_STAGES] = {
+    "lavfi.proxy.writable_us",
+    "lavfi.proxy.clear_us",
+    "lavfi.proxy.render_us",
+    "lavfi.proxy.blend_us",
+    "lavfi.proxy.push_us",
+    "lavfi.proxy.scale_us",
+};
+
+typedef struct {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  int64_t max;
+} Histogram;
+
+enum { TRANSPORT_DLOPEN, TRANSPORT_SHM };
+
+enum { DEADLINE_IDLE, DEADLINE_PENDING, DEADLINE_DONE };
+
+enum { SHM_MSG_HELLO = 1, SHM_MSG_FRAME, SHM_MSG_CONFIG };
+
+typedef struct {
+  uint32_t type;
+  uint32_t slot;
+  int32_t rc;
+  int32_t width;
+  int32_t height;
+  int32_t line_size;
+  uint32_t nb_slots;
+  uint32_t slot_size;
+  double ts_millis;
+} ShmMessage;
+
+typedef struct {
+  const char* hw_format;
+  const char* sw_format;
+  int width;
+  int height;
+  void* hwctx;
+  void* surface;
+  int nb_planes;
+  uint8_t* data[4];
+  int line_size[4];
+  int fd[4];
+  int64_t offset[4];
+  uint32_t drm_format;
+  uint64_t modifier;
+} ProxyHwFrame;
+
+typedef struct {
+  unsigned char* data;
+  unsigned int data_size;
+  int width;
+  int height;
+  int line_size;
+  double ts_millis;
+} ProxyFrame;
+
+typedef struct {
+  int64_t start;
+  int64_t end;
+  int64_t pts;
+  int tid;
+  int stage;
+} TraceEvent;
+
+typedef struct TraceBlock {
+  struct TraceBlock* next;
+  int nb_events;
+  TraceEvent events[TRACE_BLOCK_EVENTS];
+} TraceBlock;
+
+typedef struct {
+  int64_t window;
+  int count;
+  int suppressed;
+} LogLimit;
+
+typedef struct TraceBuffer {
+  struct TraceBuffer* next;
+  char name[32];
+  int tid;
+  TraceBlock* head;
+  TraceBlock* tail;
+  int nb_blocks;
+  uint64_t dropped;
+} TraceBuffer;
+
+typedef struct {
+  int version;
+  int (*execute)(int (*)(void*, int, int), void*, int);
+  int (*nb_threads)(void);
+  void* (*alloc)(size_t);
+  void (*free)(void*);
+  void (*log)(int, const char*, ...);
+} ProxyHost;
+
+typedef struct {
+  int (*fn)(void*, int, int);
+  void* arg;
+  atomic_int rc;
+} HostJobs;
+
+typedef struct {
+  int version;
+  int size;
+  const char* pix_fmt;
+  int width;
+  int height;
+  int nb_planes;
+  unsigned char* data[4];
+  int line_size[4];
+  unsigned int data_size;
+  int64_t pts;
+  int time_base_num;
+  int time_base_den;
+  int64_t frame_index;
+  double ts_millis;
+  uint32_t flags;
+} ProxyFrameDesc;
+
+typedef struct {
+  pthread_mutex_t lock;
+  uint8_t* base;
+  size_t slot_size;
+  int nb_slots;
+  int refs;
+  uint8_t busy[MAX_SLOTS];
+} ShmRing;
+
+typedef struct {
+  AVFrame* frame;
+  unsigned int data_size;
+  double ts_millis;
+  int started;
+  int done;
+  int rc;
+  int64_t sent;
+  int64_t queued;
+  int64_t index;
+  int64_t timings[NB_STAGES];
+} PendingFrame;
+
+typedef struct {
+  AVFrame* frame;
+  int64_t pts;
+  int done;
+  int rc;
+  int64_t timings[NB_STAGES];
+} LookaheadFrame;
+
+typedef struct SharedFilter {
+  struct SharedFilter* next;
+  char* key;
+  char* config;
+  void* handle;
+  void* user_data;
+  int refs;
+  int thread_safe;
+  pthread_rwlock_t lock;
+} SharedFilter;
+
+typedef struct {
+  AVFilterContext* ctx;
+  pthread_t thread;
+  void* user_data;
+} ProxyWorker;
+
+typedef struct {
+  AVFrame* frame;
+  const AVFrame* overlay;
+  int x;
+  int y;
+  double ts_millis;
+  int clear;
+  const int* xmap;
+} ThreadData;
+
+typedef struct {
+  int y[3];
+  int u[3];
+  int v[3];
+  int y_offset;
+  int c_offset;
+  int max;
+} BlendCoeffs;
+
+typedef struct {
+  void (*release)(void*, unsigned char*);
+  void* opaque;
+  void* handle;
+} OwnedBuffer;
+
+typedef struct {
+  int w;
+  int h;
+  int* xmap;
+  AVFrame* last;
+} ScaledOutput;
+
 typedef struct {
   const AVClass* class;
   char* filter_path;
   char* config;
   int clear;
+  char* clear_rect;
+  int clear_x;
+  int clear_y;
+  int clear_w;
+  int clear_h;
+  int render_x;
+  int render_y;
+  int render_w;
+  int render_h;
+  int region;
+  int region_w;
+  int region_h;
   void* handle;
   void* user_data;
+  char* share;
+  SharedFilter* shared;
+  int shared_locked;
+  AVRational render_rate;
+  int64_t tick;
+  int has_tick;
+  int alpha_bbox;
+  int bbox_valid;
+  int transparent;
+  int bbox[4];
+  AVFrame* bbox_view;
+  int bind_now;
+  int warmup;
+  int warmup_w;
+  int warmup_h;
+  int warmed_up;
   int (*filter_init)(const char*, void**);
+  int (*filter_init2)(const char*, const ProxyHost*, void**);
+  int host_ref;
   int (*filter_frame)(unsigned char*,
                       unsigned int,
                       int,
@@ -34,183 +329,4841 @@ typedef struct {
                       double,
                       void*);
   void (*filter_uninit)(void*);
+  int (*filter_send_frame)(unsigned char*,
+                           unsigned int,
+                           int,
+                           int,
+                           int,
+                           double,
+                           void*);
+  int (*filter_receive_frame)(unsigned char**, int, void*);
+  int (*filter_stateless)(void);
+  int (*filter_frame2)(const ProxyFrameDesc*, void*);
+  uint64_t (*filter_get_caps)(void);
+  int stateless;
+  int thread_safe;
+  ProxyFrameDesc desc;
+  int64_t nb_frames;
+  int (*filter_slice)(unsigned char*,
+                      int,
+                      int,
+                      int,
+                      int,
+                      int,
+                      double,
+                      void*);
+  int* slice_rc;
+  int nb_slices;
+  int (*filter_damage)(double, int*, int, int*, void*);
+  AVFrame* canvas[2];
+  int damage[4 * MAX_RECTS];
+  int nb_damage;
+  const char* (*filter_query_formats)(void*);
+  int (*filter_frame_planes)(unsigned char**,
+                             int*,
+                             int,
+                             int,
+                             int,
+                             const char*,
+                             double,
+                             void*);
+  int blend;
+  AVFrame* scratch[2];
+  int scratch_size;
+  int scratch_rendered;
+  int back_clean;
+  AVFrame* last_out;
+  int keep_last;
+  AVFrame* spare;
+  int discard_input;
+  AVBufferPool* pool;
+  int pool_line_size;
+  int w;
+  int h;
+  AVRational frame_rate;
+  int64_t duration;
+  int64_t pts;
+  int transport;
+  char* socket_path;
+  int (*filter_frame_hw)(const ProxyHwFrame*, double, void*);
+  int (*filter_frames)(const ProxyFrame*, int, void*);
+  int (*filter_reconfigure)(const char*, void*);
+  int batch;
+  int (*filter_get_frame)(int,
+                          int,
+                          double,
+                          unsigned char**,
+                          int*,
+                          void (**)(void*, unsigned char*),
+                          void**,
+                          void*);
+  int nb_slots;
+  int sock;
+  int memfd;
+  ShmRing* ring;
+  int line_size;
+  int64_t timings[NB_STAGES];
+  Histogram hist[NB_STAGES];
+  int hsub;
+  int vsub;
+  int blend_depth;
+  BlendCoeffs coeffs;
+  int depth;
+  int nb_workers;
+  ProxyWorker* workers;
+  int nb_workers_init;
+  int nb_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t job_cond;
+  pthread_cond_t done_cond;
+  int threaded;
+  int exiting;
+  int locks_init;
+  int lookahead;
+  pthread_t la_thread;
+  int la_running;
+  int la_busy;
+  LookaheadFrame la[MAX_DEPTH];
+  int la_head;
+  int nb_la;
+  int64_t la_base;
+  int64_t la_base_index;
+  int64_t la_count;
+  uint64_t la_hits;
+  uint64_t la_misses;
+  int deadline_ms;
+  pthread_t dl_thread;
+  int dl_running;
+  int dl_state;
+  AVFrame* dl_frame;
+  unsigned int dl_data_size;
+  double dl_ts_millis;
+  int dl_rc;
+  int64_t dl_timings[NB_STAGES];
+  uint64_t dl_misses;
+  uint64_t dl_late;
+  int64_t dl_pts;
+  int64_t dl_index;
+  char* trace_file;
+  FILE* trace;
+  TraceBuffer* traces;
+  TraceBuffer* trace_main;
+  LogLimit log_limit;
+  char* outputs;
+  ScaledOutput scaled[MAX_OUTPUTS];
+  int nb_scaled;
+  int scaled_reuse;
+  char* affinity;
+  int numa_node;
+  int sched_priority;
+  cpu_set_t cpus;
+  int has_cpus;
+  PendingFrame pending[MAX_DEPTH];
+  int pending_head;
+  int nb_pending;
 } ProxyContext;
 
 #define OFFSET(x) offsetof(ProxyContext, x)
 #define FLAGS AV_OPT_FLAG_FILTERING_PARAM | AV_OPT_FLAG_VIDEO_PARAM
 
-static av_cold int init(AVFilterContext* ctx) {
-  ProxyContext* pc = ctx->priv;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static SharedFilter* shared_filters;
 
-  if (!pc->filter_path) {
-    av_log(ctx, AV_LOG_ERROR, "no filter path provided!\n");
-    return AVERROR(EINVAL);
+static int hist_bucket(uint32_t v) {
+  if (v < (1 << HIST_SUB_BITS)) {
+    return v;
   }
 
-  pc->handle = dlopen(pc->filter_path, RTLD_LAZY);
-  if (!pc->handle) {
-    av_log(ctx, AV_LOG_ERROR, "%s\n", dlerror());
-    return AVERROR(EINVAL);
+  int e = av_log2(v);
+  return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+         ((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static int64_t hist_value(int bucket) {
+  if (bucket < (1 << HIST_SUB_BITS)) {
+    return bucket;
   }
 
-  char* error;
-  pc->filter_init = dlsym(pc->handle, "filter_init");
-  if ((error = dlerror()) != NULL) {
-    av_log(ctx, AV_LOG_ERROR, "%s\n", error);
-    dlclose(pc->handle);
-    return AVERROR(EINVAL);
+  int e = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  int m = bucket & ((1 << HIST_SUB_BITS) - 1);
+  return (int64_t)((1 << HIST_SUB_BITS) + m) << (e - HIST_SUB_BITS);
+}
+
+static void hist_add(Histogram* h, int64_t v) {
+  v = av_clip64(v, 0, UINT32_MAX);
+  h->counts[hist_bucket(v)]++;
+  h->total++;
+  h->max = FFMAX(h->max, v);
+}
+
+static int64_t hist_percentile(const Histogram* h, double p) {
+  uint64_t target = ceil(h->total * p);
+  uint64_t count = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    count += h->counts[i];
+    if (count >= target) {
+      return FFMIN(hist_value(i), h->max);
+    }
   }
 
-  pc->filter_frame = dlsym(pc->handle, "filter_frame");
-  if ((error = dlerror()) != NULL) {
-    av_log(ctx, AV_LOG_ERROR, "%s\n", error);
-    dlclose(pc->handle);
-    return AVERROR(EINVAL);
+  return h->max;
+}
+
+// The pts and index of the frame this thread is working on, for traces and
+// frame descriptors.
+static _Thread_local int64_t frame_pts = AV_NOPTS_VALUE;
+static _Thread_local int64_t frame_index = -1;
+
+// Each thread records events into a buffer of its own, without locking,
+// and the buffers are written out once the threads are gone.
+static _Thread_local TraceBuffer* trace_buf;
+static _Thread_local int trace_tid;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int trace_gettid(void) {
+  if (!trace_tid) {
+    trace_tid = syscall(SYS_gettid);
   }
+  return trace_tid;
+}
 
-  pc->filter_uninit = dlsym(pc->handle, "filter_uninit");
-  if ((error = dlerror()) != NULL) {
-    av_log(ctx, AV_LOG_ERROR, "%s\n", error);
-    dlclose(pc->handle);
-    return AVERROR(EINVAL);
+// Named buffers are for proxy owned threads, the unnamed one is used by
+// whichever thread runs the filter graph.
+static TraceBuffer* trace_new(ProxyContext* pc, const char* name) {
+  TraceBuffer* buf = av_mallocz(sizeof(*buf));
+  if (!buf) {
+    return NULL;
   }
 
-  int rc;
-  if ((rc = pc->filter_init(pc->config, &pc->user_data)) != 0) {
-    av_log(ctx, AV_LOG_ERROR, "filter_init returned: %d\n", rc);
-    dlclose(pc->handle);
-    return AVERROR(EINVAL);
+  if (name) {
+    av_strlcpy(buf->name, name, sizeof(buf->name));
+    buf->tid = trace_gettid();
   }
 
-  return 0;
+  pthread_mutex_lock(&trace_lock);
+  buf->next = pc->traces;
+  pc->traces = buf;
+  pthread_mutex_unlock(&trace_lock);
+
+  return buf;
 }
 
-static av_cold void uninit(AVFilterContext* ctx) {
-  ProxyContext* pc = ctx->priv;
+// Each buffer holds at most TRACE_MAX_BLOCKS blocks, events past that are
+// only counted, so a long run can't grow the trace without bound.
+static void trace_add(int stage, int64_t start, int64_t end) {
+  TraceBuffer* buf = trace_buf;
+  TraceBlock* block = buf->tail;
 
-  if (pc->handle) {
-    if (pc->filter_uninit) {
-      pc->filter_uninit(pc->user_data);
+  if (!block || block->nb_events == TRACE_BLOCK_EVENTS) {
+    TraceBlock* next = NULL;
+    if (buf->nb_blocks < TRACE_MAX_BLOCKS) {
+      next = av_malloc(sizeof(*next));
+    }
+    if (!next) {
+      buf->dropped++;
+      return;
     }
 
-    dlclose(pc->handle);
+    next->next = NULL;
+    next->nb_events = 0;
+    if (block) {
+      block->next = next;
+    } else {
+      buf->head = next;
+    }
+    buf->tail = block = next;
+    buf->nb_blocks++;
   }
+
+  block->events[block->nb_events++] = (TraceEvent){
+      .start = start,
+      .end = end,
+      .pts = frame_pts,
+      .tid = trace_gettid(),
+      .stage = stage,
+  };
+}
+
+static void add_timing(int64_t* timings, int stage, int64_t start) {
+  int64_t end = av_gettime_relative();
+  timings[stage] = FFMAX(timings[stage], 0) + end - start;
+  if (trace_buf) {
+    trace_add(stage, start, end);
+  }
+}
+
+static void* dlsym_optional(void* handle, const char* symbol) {
+  void* sym = dlsym(handle, symbol);
+  dlerror();
+  return sym;
+}
+
+// The proxy on whose behalf this thread calls the filter, and whether it's
+// the filter graph's own thread, which may run jobs on the graph's threads.
+static _Thread_local AVFilterContext* host_ctx;
+static _Thread_local int host_graph_thread;
+
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static AVBufferPool* host_pools[HOST_POOLS];
+static int host_refs;
+static LogLimit host_log_limit;
+
+static void host_enter(AVFilterContext* ctx, int graph_thread) {
+  host_ctx = ctx;
+  host_graph_thread = graph_thread;
+  if (graph_thread || !ctx) {
+    trace_buf = ctx ? ((ProxyContext*)ctx->priv)->trace_main : NULL;
+  }
+}
+
+static int host_job(AVFilterContext* ctx, void* arg, int job, int nb_jobs) {
+  HostJobs* jobs = arg;
+  int rc = jobs->fn(jobs->arg, job, nb_jobs);
+  if (rc != 0) {
+    int expected = 0;
+    atomic_compare_exchange_strong(&jobs->rc, &expected, rc);
+  }
+  return 0;
 }
 
-static void clear_image(AVFrame* out) {
-  for (int i = 0; i < out->height; i++) {
-    for (int j = 0; j < out->width; j++) {
-      AV_WN32(out->data[0] + i * out->linesize[0] + j * 4, 0);
+// Jobs run on the graph's threads when called from the graph's thread, and
+// one after another anywhere else, including from inside another job.
+static int host_execute(int (*fn)(void*, int, int), void* arg, int nb_jobs) {
+  AVFilterContext* ctx = host_ctx;
+  if (nb_jobs <= 0) {
+    return 0;
+  }
+
+  if (!ctx || !host_graph_thread || nb_jobs == 1) {
+    for (int i = 0; i < nb_jobs; i++) {
+      int rc = fn(arg, i, nb_jobs);
+      if (rc != 0) {
+        return rc;
+      }
     }
+    return 0;
   }
+
+  HostJobs jobs = {.fn = fn, .arg = arg};
+  atomic_init(&jobs.rc, 0);
+  host_graph_thread = 0;
+  ff_filter_execute(ctx, host_job, &jobs, NULL, nb_jobs);
+  host_graph_thread = 1;
+
+  return atomic_load(&jobs.rc);
 }
 
-static int filter_frame(AVFilterLink* inlink, AVFrame* in) {
-  AVFilterContext* ctx = inlink->dst;
-  AVFilterLink* outlink = ctx->outputs[0];
+static int host_nb_threads(void) {
+  return host_ctx && host_graph_thread ? ff_filter_get_nb_threads(host_ctx)
+                                        : 1;
+}
 
-  ProxyContext* pc = ctx->priv;
+// Allocations are rounded up to a power of two and taken from a pool for
+// that size, with the buffer reference stored in front of the data.
+static void* host_alloc(size_t size) {
+  if (size > (size_t)1 << (HOST_POOLS - 1)) {
+    return NULL;
+  }
 
-  AVFrame* out;
-  int direct = 0;
-  if (av_frame_is_writable(in)) {
-    direct = 1;
-    out = in;
-  } else {
-    out = ff_get_video_buffer(outlink, outlink->w, outlink->h);
-    if (!out) {
-      av_frame_free(&in);
-      return AVERROR(ENOMEM);
+  int pool = size > HOST_MIN_ALLOC ? av_log2(size - 1) + 1 : 0;
+
+  pthread_mutex_lock(&host_lock);
+  if (!host_pools[pool]) {
+    host_pools[pool] = av_buffer_pool_init(
+        HOST_ALIGN + FFMAX((size_t)1 << pool, HOST_MIN_ALLOC), NULL);
+  }
+  AVBufferRef* buf =
+      host_pools[pool] ? av_buffer_pool_get(host_pools[pool]) : NULL;
+  pthread_mutex_unlock(&host_lock);
+
+  if (!buf) {
+    return NULL;
+  }
+
+  memcpy(buf->data, &buf, sizeof(buf));
+  return buf->data + HOST_ALIGN;
+}
+
+static void host_free(void* ptr) {
+  if (!ptr) {
+    return;
+  }
+
+  AVBufferRef* buf;
+  memcpy(&buf, (uint8_t*)ptr - HOST_ALIGN, sizeof(buf));
+  av_buffer_unref(&buf);
+}
+
+// At most HOST_LOG_RATE messages are logged per second for each proxy, the
+// rest are counted and reported once the second is up. Threads not working
+// for any proxy share one limit.
+static void host_log(int level, const char* fmt, ...) {
+  if (level > av_log_get_level()) {
+    return;
+  }
+
+  LogLimit* limit = host_ctx ? &((ProxyContext*)host_ctx->priv)->log_limit
+                             : &host_log_limit;
+  int64_t now = av_gettime_relative();
+  int suppressed = 0;
+
+  pthread_mutex_lock(&host_lock);
+  if (now - limit->window >= 1000000) {
+    suppressed = limit->suppressed;
+    limit->window = now;
+    limit->count = 0;
+    limit->suppressed = 0;
+  }
+  int log = limit->count++ < HOST_LOG_RATE;
+  if (!log) {
+    limit->suppressed++;
+  }
+  pthread_mutex_unlock(&host_lock);
+
+  if (suppressed) {
+    av_log(host_ctx, AV_LOG_WARNING, "%d filter log messages suppressed\n",
+           suppressed);
+  }
+
+  if (log) {
+    va_list vl;
+    va_start(vl, fmt);
+    av_vlog(host_ctx, level, fmt, vl);
+    va_end(vl);
+  }
+}
+
+static const ProxyHost host_api = {
+    .version = PROXY_HOST_VERSION,
+    .execute = host_execute,
+    .nb_threads = host_nb_threads,
+    .alloc = host_alloc,
+    .free = host_free,
+    .log = host_log,
+};
+
+static void host_ref(void) {
+  pthread_mutex_lock(&host_lock);
+  host_refs++;
+  pthread_mutex_unlock(&host_lock);
+}
+
+// Buffers still allocated keep their pool alive until they're freed.
+static void host_unref(void) {
+  pthread_mutex_lock(&host_lock);
+  if (!--host_refs) {
+    for (int i = 0; i < HOST_POOLS; i++) {
+      av_buffer_pool_uninit(&host_pools[i]);
     }
+  }
+  pthread_mutex_unlock(&host_lock);
+}
 
-    av_frame_copy_props(out, in);
+static int call_filter_init(ProxyContext* pc, void** user_data) {
+  if (pc->filter_init2) {
+    return pc->filter_init2(pc->config, &host_api, user_data);
   }
 
-  av_assert0(in->format != -1);
+  return pc->filter_init(pc->config, user_data);
+}
+
+static PendingFrame* next_job(ProxyContext* pc) {
+  for (int i = 0; i < pc->nb_pending; i++) {
+    PendingFrame* p = &pc->pending[(pc->pending_head + i) % MAX_DEPTH];
+    if (!p->started) {
+      return p;
+    }
+  }
 
-  int data_size =
-      av_image_get_buffer_size(in->format, in->width, in->height, 1);
+  return NULL;
+}
+
+// Fills in the fields of the frame descriptor that are the same for every
+// frame.
+static int fill_desc(ProxyContext* pc,
+                     int format,
+                     int w,
+                     int h,
+                     AVRational time_base) {
+  int data_size = av_image_get_buffer_size(format, w, h, 1);
   if (data_size < 0) {
-    av_log(ctx, AV_LOG_ERROR, "error getting buffer size\n");
     return data_size;
   }
 
-  if (pc->clear) {
-    clear_image(out);
+  pc->desc = (ProxyFrameDesc){
+      .version = PROXY_FRAME_VERSION,
+      .size = sizeof(ProxyFrameDesc),
+      .pix_fmt = av_get_pix_fmt_name(format),
+      .width = w,
+      .height = h,
+      .nb_planes = av_pix_fmt_count_planes(format),
+      .data_size = data_size,
+      .time_base_num = time_base.num,
+      .time_base_den = time_base.den,
+  };
+
+  return 0;
+}
+
+static int call_filter_frame(ProxyContext* pc,
+                             AVFrame* out,
+                             unsigned int data_size,
+                             double time_ms,
+                             int flags,
+                             void* user_data) {
+  if (pc->filter_frame2) {
+    ProxyFrameDesc desc = pc->desc;
+    for (int i = 0; i < desc.nb_planes; i++) {
+      desc.data[i] = out->data[i];
+      desc.line_size[i] = out->linesize[i];
+    }
+    desc.pts = frame_pts;
+    desc.frame_index = frame_index;
+    desc.ts_millis = time_ms;
+    desc.flags = flags;
+    return pc->filter_frame2(&desc, user_data);
   }
 
-  double time_ms = in->pts * av_q2d(inlink->time_base) * 1000;
+  if (pc->filter_frame_planes) {
+    return pc->filter_frame_planes(
+        out->data, out->linesize, av_pix_fmt_count_planes(out->format),
+        out->width, out->height, av_get_pix_fmt_name(out->format), time_ms,
+        user_data);
+  }
 
-  int rc = pc->filter_frame(out->data[0], data_size, in->width, in->height,
-                            in->linesize[0], time_ms, pc->user_data);
+  return pc->filter_frame(out->data[0], data_size, out->width, out->height,
+                          out->linesize[0], time_ms, user_data);
+}
 
-  if (!direct) {
-    av_frame_free(&in);
+// Moves a thread owned by the proxy onto its CPUs and scheduling priority.
+// Failing to is only a warning, e.g. without the privileges for SCHED_FIFO.
+static void place_thread(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+  int ret;
+
+  if (pc->has_cpus &&
+      (ret = pthread_setaffinity_np(pthread_self(), sizeof(pc->cpus),
+                                    &pc->cpus))) {
+    av_log(ctx, AV_LOG_WARNING, "error setting thread affinity: %s\n",
+           strerror(ret));
   }
 
-  if (rc != 0) {
-    av_log(ctx, AV_LOG_ERROR, "filter_frame returned: %d\n", rc);
-    return AVERROR_UNKNOWN;
+  if (pc->sched_priority) {
+    struct sched_param param = {.sched_priority = pc->sched_priority};
+    if ((ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))) {
+      av_log(ctx, AV_LOG_WARNING, "error setting thread priority: %s\n",
+             strerror(ret));
+    }
+  }
+}
+
+static void* worker_thread(void* arg) {
+  ProxyWorker* w = arg;
+  ProxyContext* pc = w->ctx->priv;
+
+  host_enter(w->ctx, 0);
+  place_thread(w->ctx);
+  if (pc->trace) {
+    char name[32];
+    snprintf(name, sizeof(name), "proxy worker %d", (int)(w - pc->workers));
+    trace_buf = trace_new(pc, name);
+  }
+
+  pthread_mutex_lock(&pc->lock);
+  for (;;) {
+    PendingFrame* job;
+    while (!pc->exiting && !(job = next_job(pc))) {
+      pthread_cond_wait(&pc->job_cond, &pc->lock);
+    }
+
+    if (pc->exiting) {
+      break;
+    }
+
+    job->started = 1;
+    pthread_mutex_unlock(&pc->lock);
+
+    int64_t start = av_gettime_relative();
+    frame_pts = job->frame->pts;
+    frame_index = job->index;
+    if (trace_buf) {
+      trace_add(TRACE_QUEUE, job->queued, start);
+    }
+
+    int rc = call_filter_frame(pc, job->frame, job->data_size, job->ts_millis,
+                               0, w->user_data);
+    add_timing(job->timings, STAGE_RENDER, start);
+
+    pthread_mutex_lock(&pc->lock);
+    job->rc = rc;
+    job->done = 1;
+    pthread_cond_signal(&pc->done_cond);
   }
+  pthread_mutex_unlock(&pc->lock);
 
-  return ff_filter_frame(outlink, out);
+  return NULL;
 }
 
-static int config_input(AVFilterLink* inlink) {
-  return 0;
+static void shm_ring_unref(ShmRing* ring) {
+  pthread_mutex_lock(&ring->lock);
+  int refs = --ring->refs;
+  pthread_mutex_unlock(&ring->lock);
+
+  if (!refs) {
+    munmap(ring->base, ring->slot_size * ring->nb_slots);
+    pthread_mutex_destroy(&ring->lock);
+    av_free(ring);
+  }
 }
 
-static const AVFilterPad inputs[] = {{
-    .name = "default",
-    .type = AVMEDIA_TYPE_VIDEO,
-    .filter_frame = filter_frame,
-    .config_props = config_input,
-    .flags = AVFILTERPAD_FLAG_NEEDS_WRITABLE,
-}};
+static void shm_slot_free(void* opaque, uint8_t* data) {
+  ShmRing* ring = opaque;
 
-static const AVFilterPad outputs[] = {{
-    .name = "default",
-    .type = AVMEDIA_TYPE_VIDEO,
-}};
+  pthread_mutex_lock(&ring->lock);
+  ring->busy[(data - ring->base) / ring->slot_size] = 0;
+  pthread_mutex_unlock(&ring->lock);
 
-static const AVOption proxy_options[] = {
-    {"filter_path",
-     "set the filter path",
-     OFFSET(filter_path),
-     AV_OPT_TYPE_STRING,
-     {.str = NULL},
-     CHAR_MIN,
-     CHAR_MAX,
-     FLAGS},
-    {"config",
-     "set the config",
-     OFFSET(config),
-     AV_OPT_TYPE_STRING,
-     {.str = ""},
-     CHAR_MIN,
-     CHAR_MAX,
-     FLAGS},
-    {"clear",
-     "clear frame before filtering",
-     OFFSET(clear),
-     AV_OPT_TYPE_BOOL,
-     {.i64 = 0},
-     0,
-     1,
-     FLAGS},
-    {NULL},
-};
+  shm_ring_unref(ring);
+}
 
-AVFILTER_DEFINE_CLASS(proxy);
+static int shm_owns(const ShmRing* ring, const AVFrame* frame) {
+  return frame->data[0] >= ring->base &&
+         frame->data[0] < ring->base + ring->slot_size * ring->nb_slots;
+}
 
-const AVFilter ff_vf_proxy = {
-    .name = "proxy",
-    .description = NULL_IF_CONFIG_SMALL("Video filter proxy."),
-    .priv_size = sizeof(ProxyContext),
-    .init = init,
-    .uninit = uninit,
+static int shm_nb_free(ShmRing* ring) {
+  int nb_free = 0;
+
+  pthread_mutex_lock(&ring->lock);
+  for (int i = 0; i < ring->nb_slots; i++) {
+    nb_free += !ring->busy[i];
+  }
+  pthread_mutex_unlock(&ring->lock);
+
+  return nb_free;
+}
+
+static AVFrame* shm_get_frame(ProxyContext* pc, int w, int h) {
+  ShmRing* ring = pc->ring;
+
+  pthread_mutex_lock(&ring->lock);
+  int slot = 0;
+  while (slot < ring->nb_slots && ring->busy[slot]) {
+    slot++;
+  }
+
+  if (slot == ring->nb_slots) {
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+  }
+
+  ring->busy[slot] = 1;
+  ring->refs++;
+  pthread_mutex_unlock(&ring->lock);
+
+  uint8_t* data = ring->base + slot * ring->slot_size;
+  AVFrame* frame = av_frame_alloc();
+  if (frame) {
+    frame->buf[0] =
+        av_buffer_create(data, ring->slot_size, shm_slot_free, ring, 0);
+  }
+
+  if (!frame || !frame->buf[0]) {
+    av_frame_free(&frame);
+    shm_slot_free(ring, data);
+    return NULL;
+  }
+
+  frame->data[0] = data;
+  frame->linesize[0] = pc->line_size;
+  frame->width = w;
+  frame->height = h;
+  frame->format = AV_PIX_FMT_BGRA;
+
+  return frame;
+}
+
+static int shm_send_frame(unsigned char* data,
+                          unsigned int data_size,
+                          int width,
+                          int height,
+                          int line_size,
+                          double ts_millis,
+                          void* user_data) {
+  ProxyContext* pc = ((AVFilterContext*)user_data)->priv;
+  ShmMessage msg = {
+      .type = SHM_MSG_FRAME,
+      .slot = (data - pc->ring->base) / pc->ring->slot_size,
+      .width = width,
+      .height = height,
+      .line_size = line_size,
+      .ts_millis = ts_millis,
+  };
+
+  if (send(pc->sock, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+    av_log(user_data, AV_LOG_ERROR, "error sending frame: %s\n",
+           strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int shm_receive_frame(unsigned char** data,
+                             int block,
+                             void* user_data) {
+  ProxyContext* pc = ((AVFilterContext*)user_data)->priv;
+  ShmMessage msg;
+
+  ssize_t n = recv(pc->sock, &msg, sizeof(msg), block ? 0 : MSG_DONTWAIT);
+  if (n < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return RECEIVE_AGAIN;
+  }
+
+  if (n != sizeof(msg) || msg.type != SHM_MSG_FRAME ||
+      msg.slot >= pc->ring->nb_slots) {
+    av_log(user_data, AV_LOG_ERROR, "error receiving frame: %s\n",
+           n < 0 ? strerror(errno) : "renderer disconnected");
+    return -1;
+  }
+
+  // The renderer's code is logged here, as any value could collide with
+  // RECEIVE_AGAIN or FRAME_UNCHANGED.
+  if (msg.rc != 0) {
+    av_log(user_data, AV_LOG_ERROR, "renderer returned: %d\n", msg.rc);
+    return AVERROR_EXTERNAL;
+  }
+
+  *data = pc->ring->base + msg.slot * pc->ring->slot_size;
+  return 0;
+}
+
+static av_cold int init_shm(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+
+  if (!pc->socket_path) {
+    av_log(ctx, AV_LOG_ERROR, "no socket path provided!\n");
+    return AVERROR(EINVAL);
+  }
+
+  if (pc->nb_workers > 1 || pc->blend || pc->batch > 1 || pc->lookahead) {
+    av_log(ctx, AV_LOG_ERROR,
+           "workers, blend, batch and lookahead can't be used with the shm "
+           "transport\n");
+    return AVERROR(EINVAL);
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(pc->socket_path) >= sizeof(addr.sun_path)) {
+    av_log(ctx, AV_LOG_ERROR, "socket path too long\n");
+    return AVERROR(EINVAL);
+  }
+  av_strlcpy(addr.sun_path, pc->socket_path, sizeof(addr.sun_path));
+
+  pc->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (pc->sock < 0 ||
+      connect(pc->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    av_log(ctx, AV_LOG_ERROR, "error connecting to %s: %s\n",
+           pc->socket_path, strerror(err));
+    return AVERROR(err);
+  }
+
+  pc->filter_send_frame = shm_send_frame;
+  pc->filter_receive_frame = shm_receive_frame;
+  pc->user_data = ctx;
+
+  return 0;
+}
+
+static av_cold int config_shm(AVFilterContext* ctx, AVFilterLink* inlink) {
+  ProxyContext* pc = ctx->priv;
+
+  if (pc->ring) {
+    av_log(ctx, AV_LOG_ERROR, "the shm transport can't be reconfigured\n");
+    return AVERROR(ENOSYS);
+  }
+
+  pc->line_size = FFALIGN(inlink->w * 4, 64);
+  size_t slot_size = FFALIGN((size_t)pc->line_size * inlink->h, 4096);
+
+  pc->memfd = memfd_create("ffmpeg-proxy", MFD_CLOEXEC);
+  if (pc->memfd < 0 || ftruncate(pc->memfd, slot_size * pc->nb_slots) < 0) {
+    int err = errno;
+    av_log(ctx, AV_LOG_ERROR, "error creating shared memory: %s\n",
+           strerror(err));
+    return AVERROR(err);
+  }
+
+  ShmRing* ring = av_mallocz(sizeof(*ring));
+  if (!ring) {
+    return AVERROR(ENOMEM);
+  }
+
+  ring->base = mmap(NULL, slot_size * pc->nb_slots, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, pc->memfd, 0);
+  if (ring->base == MAP_FAILED) {
+    int err = errno;
+    av_log(ctx, AV_LOG_ERROR, "error mapping shared memory: %s\n",
+           strerror(err));
+    av_free(ring);
+    return AVERROR(err);
+  }
+
+  pthread_mutex_init(&ring->lock, NULL);
+  ring->slot_size = slot_size;
+  ring->nb_slots = pc->nb_slots;
+  ring->refs = 1;
+  pc->ring = ring;
+
+  ShmMessage msg = {
+      .type = SHM_MSG_HELLO,
+      .width = inlink->w,
+      .height = inlink->h,
+      .line_size = pc->line_size,
+      .nb_slots = pc->nb_slots,
+      .slot_size = slot_size,
+  };
+
+  char cmsg_buf[CMSG_SPACE(sizeof(int))] = {0};
+  struct iovec iov = {.iov_base = &msg, .iov_len = sizeof(msg)};
+  struct msghdr mh = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = cmsg_buf,
+      .msg_controllen = sizeof(cmsg_buf),
+  };
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &pc->memfd, sizeof(int));
+
+  const char* config = pc->config ? pc->config : "";
+  if (sendmsg(pc->sock, &mh, MSG_NOSIGNAL) != sizeof(msg) ||
+      send(pc->sock, config, strlen(config) + 1, MSG_NOSIGNAL) < 0 ||
+      recv(pc->sock, &msg, sizeof(msg), 0) != sizeof(msg)) {
+    av_log(ctx, AV_LOG_ERROR, "error initializing renderer: %s\n",
+           strerror(errno));
+    return AVERROR(EIO);
+  }
+
+  if (msg.type != SHM_MSG_HELLO || msg.rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "renderer init returned: %d\n", msg.rc);
+    return AVERROR(EINVAL);
+  }
+
+  return 0;
+}
+
+static int shm_prepare_frame(AVFilterContext* ctx, AVFrame** frame) {
+  ProxyContext* pc = ctx->priv;
+  AVFrame* in = *frame;
+
+  if (!pc->discard_input && shm_owns(pc->ring, in)) {
+    return 0;
+  }
+
+  AVFrame* out = shm_get_frame(pc, in->width, in->height);
+  if (!out) {
+    av_log(ctx, AV_LOG_ERROR,
+           "no free slot in the shared memory ring, slots should be larger "
+           "than depth\n");
+    return AVERROR(ENOBUFS);
+  }
+
+  int ret = av_frame_copy_props(out, in);
+  if (ret >= 0 && !pc->discard_input) {
+    ret = av_frame_copy(out, in);
+  }
+
+  if (ret < 0) {
+    av_frame_free(&out);
+    return ret;
+  }
+
+  av_frame_free(frame);
+  *frame = out;
+
+  return 0;
+}
+
+// A frame held downstream keeps its slot busy, so once fewer slots than depth
+// are free the rendered frames are copied out of the ring instead.
+static int shm_detach_frame(AVFilterContext* ctx, AVFrame** frame) {
+  ProxyContext* pc = ctx->priv;
+  AVFrame* in = *frame;
+
+  if (!shm_owns(pc->ring, in) || shm_nb_free(pc->ring) >= pc->depth) {
+    return 0;
+  }
+
+  AVFrame* out = ff_get_video_buffer(ctx->outputs[0], in->width, in->height);
+  if (!out) {
+    return AVERROR(ENOMEM);
+  }
+
+  int ret = av_frame_copy_props(out, in);
+  if (ret >= 0) {
+    ret = av_frame_copy(out, in);
+  }
+
+  if (ret < 0) {
+    av_frame_free(&out);
+    return ret;
+  }
+
+  av_frame_free(frame);
+  *frame = out;
+
+  return 0;
+}
+
+// Parses a CPU list like 0-7|16-23, with | or , between the ranges.
+static int parse_cpu_list(AVFilterContext* ctx,
+                          const char* str,
+                          cpu_set_t* cpus) {
+  char* list = av_strdup(str);
+  if (!list) {
+    return AVERROR(ENOMEM);
+  }
+
+  CPU_ZERO(cpus);
+
+  char* saveptr = NULL;
+  int ret = 0;
+  for (char* range = av_strtok(list, "|,", &saveptr); range;
+       range = av_strtok(NULL, "|,", &saveptr)) {
+    char* end;
+    long first = strtol(range, &end, 10);
+    long last = first;
+    if (end != range && *end == '-') {
+      last = strtol(end + 1, &end, 10);
+    }
+
+    if (end == range || *end || first < 0 || last < first ||
+        last >= CPU_SETSIZE) {
+      ret = AVERROR(EINVAL);
+      break;
+    }
+
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, cpus);
+    }
+  }
+  av_free(list);
+
+  if (ret < 0 || !CPU_COUNT(cpus)) {
+    av_log(ctx, AV_LOG_ERROR, "invalid CPU list: %s\n", str);
+    return AVERROR(EINVAL);
+  }
+
+  return 0;
+}
+
+static av_cold int init_placement(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+  int ret;
+
+  if (pc->affinity) {
+    if ((ret = parse_cpu_list(ctx, pc->affinity, &pc->cpus)) < 0) {
+      return ret;
+    }
+    pc->has_cpus = 1;
+  }
+
+  if (pc->numa_node < 0) {
+    return 0;
+  }
+
+  // The frame pool binds its memory with a single word node mask.
+  if (pc->numa_node >= sizeof(unsigned long) * 8) {
+    av_log(ctx, AV_LOG_ERROR, "numa_node must be below %d\n",
+           (int)sizeof(unsigned long) * 8);
+    return AVERROR(EINVAL);
+  }
+
+  char path[64], line[4096];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           pc->numa_node);
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    av_log(ctx, AV_LOG_ERROR, "NUMA node %d not found\n", pc->numa_node);
+    return AVERROR(EINVAL);
+  }
+
+  char* cpulist = fgets(line, sizeof(line), f);
+  fclose(f);
+  if (!cpulist) {
+    av_log(ctx, AV_LOG_ERROR, "error reading %s\n", path);
+    return AVERROR(EIO);
+  }
+  cpulist[strcspn(cpulist, "\n")] = '\0';
+
+  cpu_set_t node_cpus;
+  if ((ret = parse_cpu_list(ctx, cpulist, &node_cpus)) < 0) {
+    return ret;
+  }
+
+  if (pc->has_cpus) {
+    CPU_AND(&pc->cpus, &pc->cpus, &node_cpus);
+    if (!CPU_COUNT(&pc->cpus)) {
+      av_log(ctx, AV_LOG_ERROR, "affinity has no CPUs on NUMA node %d\n",
+             pc->numa_node);
+      return AVERROR(EINVAL);
+    }
+  } else {
+    pc->cpus = node_cpus;
+    pc->has_cpus = 1;
+  }
+
+  return 0;
+}
+
+// done_cond is waited on with a deadline, which is taken from the monotonic
+// clock so that stepping the system clock doesn't stall or miss renders.
+static av_cold void init_locks(ProxyContext* pc) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+  pthread_mutex_init(&pc->lock, NULL);
+  pthread_cond_init(&pc->job_cond, NULL);
+  pthread_cond_init(&pc->done_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pc->locks_init = 1;
+}
+
+static av_cold int init_workers(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+
+  if (pc->filter_send_frame) {
+    av_log(ctx, AV_LOG_ERROR,
+           "workers can't be used with asynchronous filters\n");
+    return AVERROR(EINVAL);
+  }
+
+  if (!pc->stateless) {
+    av_log(ctx, AV_LOG_ERROR,
+           "workers can only be used with stateless filters\n");
+    return AVERROR(EINVAL);
+  }
+
+  pc->workers = av_calloc(pc->nb_workers, sizeof(*pc->workers));
+  if (!pc->workers) {
+    return AVERROR(ENOMEM);
+  }
+
+  pc->workers[0].user_data = pc->user_data;
+  for (pc->nb_workers_init = 1; pc->nb_workers_init < pc->nb_workers;
+       pc->nb_workers_init++) {
+    ProxyWorker* w = &pc->workers[pc->nb_workers_init];
+    int rc;
+    if ((rc = call_filter_init(pc, &w->user_data)) != 0) {
+      av_log(ctx, AV_LOG_ERROR, "filter_init returned: %d\n", rc);
+      return AVERROR(EINVAL);
+    }
+  }
+
+  init_locks(pc);
+  pc->threaded = 1;
+
+  for (; pc->nb_threads < pc->nb_workers; pc->nb_threads++) {
+    ProxyWorker* w = &pc->workers[pc->nb_threads];
+    w->ctx = ctx;
+    int ret = pthread_create(&w->thread, NULL, worker_thread, w);
+    if (ret) {
+      av_log(ctx, AV_LOG_ERROR, "error creating worker thread\n");
+      return AVERROR(ret);
+    }
+  }
+
+  if (pc->depth < pc->nb_workers) {
+    pc->depth = pc->nb_workers;
+  }
+
+  return 0;
+}
+
+static av_cold int init_shared(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+  const char* config = pc->config ? pc->config : "";
+  int ret = 0;
+
+  pthread_mutex_lock(&shared_lock);
+  SharedFilter* sf = shared_filters;
+  while (sf && strcmp(sf->key, pc->share)) {
+    sf = sf->next;
+  }
+
+  if (sf) {
+    if (sf->handle != pc->handle || strcmp(sf->config, config)) {
+      av_log(ctx, AV_LOG_ERROR,
+             "share key %s is used with another filter or config\n",
+             pc->share);
+      ret = AVERROR(EINVAL);
+      goto end;
+    }
+    sf->refs++;
+  } else {
+    sf = av_mallocz(sizeof(*sf));
+    if (!sf || !(sf->key = av_strdup(pc->share)) ||
+        !(sf->config = av_strdup(config))) {
+      ret = AVERROR(ENOMEM);
+      goto fail;
+    }
+
+    int rc;
+    if ((rc = call_filter_init(pc, &sf->user_data)) != 0) {
+      av_log(ctx, AV_LOG_ERROR, "filter_init returned: %d\n", rc);
+      ret = AVERROR(EINVAL);
+      goto fail;
+    }
+
+    sf->handle = pc->handle;
+    sf->thread_safe = pc->thread_safe;
+    sf->refs = 1;
+    // Writers are preferred so that a config change isn't held off for long
+    // by the renders of a thread safe filter.
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&sf->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    sf->next = shared_filters;
+    shared_filters = sf;
+  }
+
+  pc->shared = sf;
+  pc->user_data = sf->user_data;
+  goto end;
+
+fail:
+  if (sf) {
+    av_free(sf->key);
+    av_free(sf->config);
+    av_free(sf);
+  }
+end:
+  pthread_mutex_unlock(&shared_lock);
+  return ret;
+}
+
+// Returns nonzero if the caller holds the last reference to the filter
+// instance and should uninitialize it.
+static av_cold int unref_shared(ProxyContext* pc) {
+  SharedFilter* sf = pc->shared;
+  if (!sf) {
+    return 1;
+  }
+  pc->shared = NULL;
+
+  pthread_mutex_lock(&shared_lock);
+  int last = !--sf->refs;
+  if (last) {
+    SharedFilter** p = &shared_filters;
+    while (*p != sf) {
+      p = &(*p)->next;
+    }
+    *p = sf->next;
+  }
+  pthread_mutex_unlock(&shared_lock);
+
+  if (last) {
+    pthread_rwlock_destroy(&sf->lock);
+    av_free(sf->key);
+    av_free(sf->config);
+    av_free(sf);
+  }
+
+  return last;
+}
+
+// A shared filter is used by one proxy at a time, or by any number of them if
+// it's thread safe, but it's always reconfigured by only one.
+static void lock_shared(ProxyContext* pc) {
+  if (pc->shared->thread_safe) {
+    pthread_rwlock_rdlock(&pc->shared->lock);
+  } else {
+    pthread_rwlock_wrlock(&pc->shared->lock);
+  }
+}
+
+static void unlock_shared(ProxyContext* pc) {
+  pthread_rwlock_unlock(&pc->shared->lock);
+}
+
+// Renders a warm-up frame through the entry point that live frames use.
+static int warmup_frame(ProxyContext* pc,
+                        AVFrame* frame,
+                        unsigned int data_size,
+                        double time_ms,
+                        void* user_data) {
+  int w = frame->width;
+  int h = frame->height;
+
+  if (pc->filter_send_frame) {
+    unsigned char* data = NULL;
+    int rc = pc->filter_send_frame(frame->data[0], data_size, w, h,
+                                   frame->linesize[0], time_ms, user_data);
+    return rc ? rc : pc->filter_receive_frame(&data, 1, user_data);
+  }
+
+  if (pc->batch > 1) {
+    ProxyFrame f = {
+        .data = frame->data[0],
+        .data_size = data_size,
+        .width = w,
+        .height = h,
+        .line_size = frame->linesize[0],
+        .ts_millis = time_ms,
+    };
+    return pc->filter_frames(&f, 1, user_data);
+  }
+
+  if (pc->filter_get_frame && pc->discard_input && !pc->threaded) {
+    unsigned char* data = NULL;
+    int line_size = 0;
+    void (*release)(void*, unsigned char*) = NULL;
+    void* opaque = NULL;
+    int rc = pc->filter_get_frame(w, h, time_ms, &data, &line_size, &release,
+                                  &opaque, user_data);
+    if (data && release) {
+      release(opaque, data);
+    }
+    return rc;
+  }
+
+  if (pc->filter_slice && av_pix_fmt_count_planes(frame->format) == 1) {
+    return pc->filter_slice(frame->data[0], frame->linesize[0], w, h, 0, h,
+                            time_ms, user_data);
+  }
+
+  return call_filter_frame(pc, frame, data_size, time_ms, PROXY_FRAME_WARMUP,
+                           user_data);
+}
+
+// Renders throwaway frames with every instance of the filter, so lazy
+// binding, JIT compilation and page faults are paid for before the first
+// real frame.
+static av_cold int warmup(AVFilterContext* ctx, int format, int w, int h) {
+  ProxyContext* pc = ctx->priv;
+
+  if (!pc->warmup || pc->warmed_up || !pc->handle) {
+    return 0;
+  }
+  pc->warmed_up = 1;
+
+  // Hardware frames are drawn on in place, there is no buffer of our own to
+  // warm up on.
+  if (av_pix_fmt_desc_get(format)->flags & AV_PIX_FMT_FLAG_HWACCEL) {
+    return 0;
+  }
+
+  AVFrame* frame = av_frame_alloc();
+  if (!frame) {
+    return AVERROR(ENOMEM);
+  }
+
+  frame->format = format;
+  frame->width = w;
+  frame->height = h;
+  int ret = av_frame_get_buffer(frame, 0);
+  if (ret < 0) {
+    av_frame_free(&frame);
+    return ret;
+  }
+
+  if ((ret = fill_desc(pc, format, w, h, AV_TIME_BASE_Q)) < 0) {
+    av_frame_free(&frame);
+    return ret;
+  }
+
+  int data_size = av_image_get_buffer_size(format, w, h, 1);
+  int nb_instances = FFMAX(pc->nb_workers_init, 1);
+  if (pc->shared) {
+    lock_shared(pc);
+  }
+  frame_pts = AV_NOPTS_VALUE;
+  frame_index = -1;
+
+  int64_t start = av_gettime_relative();
+  for (int i = 0; i < pc->warmup && ret >= 0; i++) {
+    for (int j = 0; j < nb_instances; j++) {
+      for (int k = 0; k < FF_ARRAY_ELEMS(frame->buf) && frame->buf[k]; k++) {
+        memset(frame->buf[k]->data, 0, frame->buf[k]->size);
+      }
+
+      void* user_data = j ? pc->workers[j].user_data : pc->user_data;
+      int rc = warmup_frame(pc, frame, data_size, i * 40.0, user_data);
+      if (rc != 0 && rc != FRAME_UNCHANGED) {
+        av_log(ctx, AV_LOG_ERROR, "filter_frame returned: %d\n", rc);
+        ret = AVERROR_UNKNOWN;
+        break;
+      }
+    }
+  }
+
+  if (pc->shared) {
+    unlock_shared(pc);
+  }
+  av_frame_free(&frame);
+
+  if (ret >= 0) {
+    av_log(ctx, AV_LOG_VERBOSE, "warmed up with %d frames in %" PRId64 "us\n",
+           pc->warmup, av_gettime_relative() - start);
+  }
+
+  return ret;
+}
+
+// Writes the recorded events in the Trace Event Format read by
+// chrome://tracing and Perfetto, with timestamps in microseconds.
+static av_cold void close_trace(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+  FILE* f = pc->trace;
+  const char* sep = "";
+  uint64_t dropped = 0;
+  int pid = getpid();
+
+  fputs("{\"traceEvents\":[", f);
+  for (TraceBuffer* buf = pc->traces; buf; buf = buf->next) {
+    if (buf->tid) {
+      fprintf(f,
+              "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+              "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+              sep, pid, buf->tid, buf->name);
+      sep = ",";
+    }
+
+    for (TraceBlock* block = buf->head; block; block = block->next) {
+      for (int i = 0; i < block->nb_events; i++) {
+        const TraceEvent* e = &block->events[i];
+        fprintf(f,
+                "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%" PRId64 ",\"dur\":%" PRId64,
+                sep, e->stage == TRACE_QUEUE ? "queue" : stage_names[e->stage],
+                pid, e->tid, e->start, e->end - e->start);
+        if (e->pts != AV_NOPTS_VALUE) {
+          fprintf(f, ",\"args\":{\"pts\":%" PRId64 "}", e->pts);
+        }
+        fputc('}', f);
+        sep = ",";
+      }
+    }
+    dropped += buf->dropped;
+  }
+  fputs("\n]}\n", f);
+
+  if (fclose(f)) {
+    av_log(ctx, AV_LOG_ERROR, "error writing %s\n", pc->trace_file);
+  }
+  pc->trace = NULL;
+
+  if (dropped) {
+    av_log(ctx, AV_LOG_WARNING, "%" PRIu64 " trace events dropped\n",
+           dropped);
+  }
+
+  while (pc->traces) {
+    TraceBuffer* buf = pc->traces;
+    pc->traces = buf->next;
+    while (buf->head) {
+      TraceBlock* block = buf->head;
+      buf->head = block->next;
+      av_free(block);
+    }
+    av_free(buf);
+  }
+  pc->trace_main = NULL;
+  trace_buf = NULL;
+}
+
+// With filter_get_caps the filter declares what it implements. Entry points
+// it doesn't declare are ignored, and the ones it declares must be there.
+static av_cold int apply_caps(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+
+  if (!pc->filter_get_caps) {
+    pc->stateless = pc->filter_stateless && pc->filter_stateless();
+    return 0;
+  }
+
+  uint64_t caps = pc->filter_get_caps();
+  const struct {
+    uint64_t cap;
+    const char* symbol;
+    int present;
+  } entry_points[] = {
+      {PROXY_CAP_FRAME2, "filter_frame2", !!pc->filter_frame2},
+      {PROXY_CAP_ASYNC, "filter_send_frame", !!pc->filter_send_frame},
+      {PROXY_CAP_SLICES, "filter_slice", !!pc->filter_slice},
+      {PROXY_CAP_DAMAGE, "filter_damage", !!pc->filter_damage},
+      {PROXY_CAP_FORMATS, "filter_query_formats", !!pc->filter_query_formats},
+      {PROXY_CAP_PLANES, "filter_frame_planes", !!pc->filter_frame_planes},
+      {PROXY_CAP_HW, "filter_frame_hw", !!pc->filter_frame_hw},
+      {PROXY_CAP_OWNED, "filter_get_frame", !!pc->filter_get_frame},
+      {PROXY_CAP_BATCH, "filter_frames", !!pc->filter_frames},
+      {PROXY_CAP_RECONFIGURE, "filter_reconfigure", !!pc->filter_reconfigure},
+  };
+
+  for (int i = 0; i < FF_ARRAY_ELEMS(entry_points); i++) {
+    if ((caps & entry_points[i].cap) && !entry_points[i].present) {
+      av_log(ctx, AV_LOG_ERROR,
+             "filter_get_caps declares %s, which is missing\n",
+             entry_points[i].symbol);
+      return AVERROR(EINVAL);
+    }
+  }
+
+  if (!(caps & PROXY_CAP_FRAME2)) {
+    pc->filter_frame2 = NULL;
+  }
+  if (!(caps & PROXY_CAP_ASYNC)) {
+    pc->filter_send_frame = NULL;
+    pc->filter_receive_frame = NULL;
+  }
+  if (!(caps & PROXY_CAP_SLICES)) {
+    pc->filter_slice = NULL;
+  }
+  if (!(caps & PROXY_CAP_DAMAGE)) {
+    pc->filter_damage = NULL;
+  }
+  if (!(caps & PROXY_CAP_FORMATS)) {
+    pc->filter_query_formats = NULL;
+  }
+  if (!(caps & PROXY_CAP_PLANES)) {
+    pc->filter_frame_planes = NULL;
+  }
+  if (!(caps & PROXY_CAP_HW)) {
+    pc->filter_frame_hw = NULL;
+  }
+  if (!(caps & PROXY_CAP_OWNED)) {
+    pc->filter_get_frame = NULL;
+  }
+  if (!(caps & PROXY_CAP_BATCH)) {
+    pc->filter_frames = NULL;
+  }
+  if (!(caps & PROXY_CAP_RECONFIGURE)) {
+    pc->filter_reconfigure = NULL;
+  }
+  pc->stateless = !!(caps & PROXY_CAP_STATELESS);
+  pc->thread_safe = !!(caps & PROXY_CAP_THREAD_SAFE);
+  if (caps & PROXY_CAP_UNCHANGED) {
+    pc->keep_last = pc->discard_input;
+  }
+
+  return 0;
+}
+
+// The extra outputs get the frames of the default output scaled down, so
+// their size is relative to the rendered one.
+static int config_scaled_output(AVFilterLink* outlink) {
+  AVFilterContext* ctx = outlink->src;
+  ProxyContext* pc = ctx->priv;
+  ScaledOutput* so = &pc->scaled[FF_OUTLINK_IDX(outlink) - 1];
+  AVRational sar = {1, 1};
+  int w = pc->w, h = pc->h;
+
+  host_enter(ctx, 1);
+
+  if (ctx->nb_inputs) {
+    AVFilterLink* inlink = ctx->inputs[0];
+    sar = inlink->sample_aspect_ratio;
+    w = pc->region ? pc->region_w : inlink->w;
+    h = pc->region ? pc->region_h : inlink->h;
+  } else {
+    outlink->frame_rate = pc->frame_rate;
+    outlink->time_base = av_inv_q(pc->frame_rate);
+  }
+
+  if (so->w > w || so->h > h) {
+    av_log(ctx, AV_LOG_ERROR, "output %dx%d is larger than the %dx%d render\n",
+           so->w, so->h, w, h);
+    return AVERROR(EINVAL);
+  }
+
+  outlink->w = so->w;
+  outlink->h = so->h;
+  outlink->sample_aspect_ratio =
+      av_mul_q(sar, (AVRational){w * so->h, so->w * h});
+
+  av_freep(&so->xmap);
+  av_frame_free(&so->last);
+  so->xmap = av_malloc_array(so->w + 1, sizeof(*so->xmap));
+  if (!so->xmap) {
+    return AVERROR(ENOMEM);
+  }
+
+  for (int x = 0; x <= so->w; x++) {
+    so->xmap[x] = (int64_t)x * w / so->w;
+  }
+
+  return 0;
+}
+
+static av_cold int init_outputs(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+
+  if (!pc->discard_input) {
+    av_log(ctx, AV_LOG_ERROR, "outputs needs clear without clear_rect\n");
+    return AVERROR(EINVAL);
+  }
+
+  char* list = av_strdup(pc->outputs);
+  if (!list) {
+    return AVERROR(ENOMEM);
+  }
+
+  char* saveptr = NULL;
+  int ret = 0;
+  for (char* size = av_strtok(list, "|", &saveptr); size;
+       size = av_strtok(NULL, "|", &saveptr)) {
+    if (pc->nb_scaled == MAX_OUTPUTS) {
+      av_log(ctx, AV_LOG_ERROR, "at most %d outputs can be added\n",
+             MAX_OUTPUTS);
+      ret = AVERROR(EINVAL);
+      break;
+    }
+
+    ScaledOutput* so = &pc->scaled[pc->nb_scaled];
+    if ((ret = av_parse_video_size(&so->w, &so->h, size)) < 0) {
+      av_log(ctx, AV_LOG_ERROR, "invalid output size: %s\n", size);
+      break;
+    }
+
+    AVFilterPad pad = {
+        .name = av_asprintf("out%d", pc->nb_scaled + 1),
+        .type = AVMEDIA_TYPE_VIDEO,
+        .config_props = config_scaled_output,
+    };
+    if (!pad.name) {
+      ret = AVERROR(ENOMEM);
+      break;
+    }
+
+    if ((ret = ff_append_outpad_free_name(ctx, &pad)) < 0) {
+      break;
+    }
+    pc->nb_scaled++;
+  }
+  av_free(list);
+
+  return ret;
+}
+
+static av_cold int preinit(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+
+  pc->sock = pc->memfd = -1;
+
+  return 0;
+}
+
+static av_cold int init(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+
+  host_enter(ctx, 1);
+
+  if (pc->clear_rect &&
+      (sscanf(pc->clear_rect, "%d|%d|%d|%d", &pc->clear_x, &pc->clear_y,
+              &pc->clear_w, &pc->clear_h) != 4 ||
+       pc->clear_x < 0 || pc->clear_y < 0 || pc->clear_w <= 0 ||
+       pc->clear_h <= 0)) {
+    av_log(ctx, AV_LOG_ERROR, "invalid clear rect: %s\n", pc->clear_rect);
+    return AVERROR(EINVAL);
+  }
+
+  pc->discard_input = pc->clear && !pc->clear_rect && !pc->blend;
+
+  // Only a fresh frame can be passed on again in place of another one, and
+  // holding on to it otherwise would keep the frames downstream unwritable.
+  pc->keep_last = pc->discard_input &&
+                  (pc->render_rate.num || pc->deadline_ms || pc->outputs);
+
+  if (pc->render_rate.num &&
+      (!(pc->discard_input || pc->blend) || pc->nb_workers > 1 ||
+       pc->batch > 1 || pc->lookahead || pc->transport == TRANSPORT_SHM)) {
+    av_log(ctx, AV_LOG_ERROR,
+           "render_rate needs clear without clear_rect or blend, and can't "
+           "be used with workers, batch, lookahead or the shm transport\n");
+    return AVERROR(EINVAL);
+  }
+
+  if (pc->deadline_ms &&
+      (!(pc->discard_input || pc->blend) || pc->nb_workers > 1 ||
+       pc->batch > 1 || pc->lookahead || pc->share ||
+       pc->transport == TRANSPORT_SHM)) {
+    av_log(ctx, AV_LOG_ERROR,
+           "deadline_ms needs clear without clear_rect or blend, and can't "
+           "be used with workers, batch, lookahead, share or the shm "
+           "transport\n");
+    return AVERROR(EINVAL);
+  }
+
+  if (pc->outputs) {
+    int ret = init_outputs(ctx);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  if (pc->affinity || pc->numa_node >= 0) {
+    int ret = init_placement(ctx);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  if (pc->trace_file) {
+    if (!(pc->trace = fopen(pc->trace_file, "w"))) {
+      int err = errno;
+      av_log(ctx, AV_LOG_ERROR, "error opening %s: %s\n", pc->trace_file,
+             strerror(err));
+      return AVERROR(err);
+    }
+
+    if (!(pc->trace_main = trace_new(pc, NULL))) {
+      return AVERROR(ENOMEM);
+    }
+    trace_buf = pc->trace_main;
+  }
+
+  if (pc->transport == TRANSPORT_SHM) {
+    if (pc->share) {
+      av_log(ctx, AV_LOG_ERROR, "share can't be used with the shm transport\n");
+      return AVERROR(EINVAL);
+    }
+    return init_shm(ctx);
+  }
+
+  if (!pc->filter_path) {
+    av_log(ctx, AV_LOG_ERROR, "no filter path provided!\n");
+    return AVERROR(EINVAL);
+  }
+
+  pc->handle = dlopen(pc->filter_path, pc->bind_now ? RTLD_NOW : RTLD_LAZY);
+  if (!pc->handle) {
+    av_log(ctx, AV_LOG_ERROR, "%s\n", dlerror());
+    return AVERROR(EINVAL);
+  }
+
+  char* error;
+  pc->filter_init2 = dlsym_optional(pc->handle, "filter_init2");
+  pc->filter_init = dlsym(pc->handle, "filter_init");
+  if ((error = dlerror()) != NULL && !pc->filter_init2) {
+    av_log(ctx, AV_LOG_ERROR, "%s\n", error);
+    dlclose(pc->handle);
+    pc->handle = NULL;
+    return AVERROR(EINVAL);
+  }
+
+  pc->filter_frame2 = dlsym_optional(pc->handle, "filter_frame2");
+  pc->filter_frame = dlsym(pc->handle, "filter_frame");
+  if ((error = dlerror()) != NULL && !pc->filter_frame2) {
+    av_log(ctx, AV_LOG_ERROR, "%s\n", error);
+    dlclose(pc->handle);
+    pc->handle = NULL;
+    return AVERROR(EINVAL);
+  }
+
+  pc->filter_uninit = dlsym(pc->handle, "filter_uninit");
+  if ((error = dlerror()) != NULL) {
+    av_log(ctx, AV_LOG_ERROR, "%s\n", error);
+    dlclose(pc->handle);
+    pc->handle = NULL;
+    return AVERROR(EINVAL);
+  }
+
+  pc->filter_send_frame = dlsym_optional(pc->handle, "filter_send_frame");
+  pc->filter_receive_frame = dlsym_optional(pc->handle, "filter_receive_frame");
+  if (!pc->filter_send_frame != !pc->filter_receive_frame) {
+    av_log(ctx, AV_LOG_ERROR,
+           "filter_send_frame and filter_receive_frame must both be "
+           "provided\n");
+    dlclose(pc->handle);
+    pc->handle = NULL;
+    return AVERROR(EINVAL);
+  }
+
+  pc->filter_stateless = dlsym_optional(pc->handle, "filter_stateless");
+  pc->filter_slice = dlsym_optional(pc->handle, "filter_slice");
+  pc->filter_damage = dlsym_optional(pc->handle, "filter_damage");
+  pc->filter_query_formats =
+      dlsym_optional(pc->handle, "filter_query_formats");
+  pc->filter_frame_planes = dlsym_optional(pc->handle, "filter_frame_planes");
+  pc->filter_frame_hw = dlsym_optional(pc->handle, "filter_frame_hw");
+  pc->filter_get_frame = dlsym_optional(pc->handle, "filter_get_frame");
+  pc->filter_frames = dlsym_optional(pc->handle, "filter_frames");
+  pc->filter_reconfigure = dlsym_optional(pc->handle, "filter_reconfigure");
+  pc->filter_get_caps = dlsym_optional(pc->handle, "filter_get_caps");
+
+  int ret = apply_caps(ctx);
+  if (ret < 0) {
+    dlclose(pc->handle);
+    pc->handle = NULL;
+    return ret;
+  }
+
+  if (!pc->filter_frame && !pc->filter_frame2) {
+    av_log(ctx, AV_LOG_ERROR, "filter_frame is missing\n");
+    dlclose(pc->handle);
+    pc->handle = NULL;
+    return AVERROR(EINVAL);
+  }
+
+  if (pc->filter_init2) {
+    host_ref();
+    pc->host_ref = 1;
+  }
+
+  if (pc->blend && (pc->filter_send_frame || pc->nb_workers > 1)) {
+    av_log(ctx, AV_LOG_ERROR,
+           "blend can't be used with asynchronous filters or workers\n");
+    dlclose(pc->handle);
+    pc->handle = NULL;
+    return AVERROR(EINVAL);
+  }
+
+  if (pc->batch > 1 && (!pc->filter_frames || pc->filter_send_frame ||
+                        pc->nb_workers > 1 || pc->blend)) {
+    av_log(ctx, AV_LOG_ERROR,
+           "batch needs filter_frames and can't be used with asynchronous "
+           "filters, workers or blend\n");
+    dlclose(pc->handle);
+    pc->handle = NULL;
+    return AVERROR(EINVAL);
+  }
+
+  if (pc->lookahead && (!pc->discard_input || pc->filter_send_frame ||
+                        pc->nb_workers > 1 || pc->batch > 1)) {
+    av_log(ctx, AV_LOG_ERROR,
+           "lookahead needs clear without clear_rect and can't be used with "
+           "asynchronous filters, workers or batch\n");
+    dlclose(pc->handle);
+    pc->handle = NULL;
+    return AVERROR(EINVAL);
+  }
+
+  if ((pc->render_rate.num || pc->deadline_ms) && pc->filter_send_frame) {
+    av_log(ctx, AV_LOG_ERROR,
+           "render_rate and deadline_ms can't be used with asynchronous "
+           "filters\n");
+    dlclose(pc->handle);
+    pc->handle = NULL;
+    return AVERROR(EINVAL);
+  }
+
+  if (pc->share) {
+    if (pc->filter_send_frame || pc->nb_workers > 1 || pc->lookahead) {
+      av_log(ctx, AV_LOG_ERROR,
+             "share can't be used with asynchronous filters, workers or "
+             "lookahead\n");
+      dlclose(pc->handle);
+      pc->handle = NULL;
+      return AVERROR(EINVAL);
+    }
+
+    ret = init_shared(ctx);
+    if (ret < 0) {
+      dlclose(pc->handle);
+      pc->handle = NULL;
+      return ret;
+    }
+  } else {
+    int rc;
+    if ((rc = call_filter_init(pc, &pc->user_data)) != 0) {
+      av_log(ctx, AV_LOG_ERROR, "filter_init returned: %d\n", rc);
+      dlclose(pc->handle);
+      pc->handle = NULL;
+      return AVERROR(EINVAL);
+    }
+  }
+
+  if (pc->nb_workers > 1 && (ret = init_workers(ctx)) < 0) {
+    return ret;
+  }
+
+  if (pc->lookahead || pc->deadline_ms) {
+    init_locks(pc);
+  }
+
+  if (pc->warmup_w) {
+    return warmup(ctx, AV_PIX_FMT_BGRA, pc->warmup_w, pc->warmup_h);
+  }
+
+  return 0;
+}
+
+static av_cold void uninit(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+
+  host_enter(ctx, 1);
+
+  for (int i = 0; i < NB_STAGES; i++) {
+    const Histogram* h = &pc->hist[i];
+    if (h->total) {
+      av_log(ctx, AV_LOG_INFO,
+             "%s: frames:%" PRIu64 " p50:%" PRId64 "us p99:%" PRId64
+             "us max:%" PRId64 "us\n",
+             stage_names[i], h->total, hist_percentile(h, 0.5),
+             hist_percentile(h, 0.99), h->max);
+    }
+  }
+
+  if (pc->lookahead) {
+    av_log(ctx, AV_LOG_INFO, "lookahead: hits:%" PRIu64 " misses:%" PRIu64 "\n",
+           pc->la_hits, pc->la_misses);
+  }
+
+  if (pc->deadline_ms) {
+    av_log(ctx, AV_LOG_INFO, "deadline: misses:%" PRIu64 " late:%" PRIu64 "\n",
+           pc->dl_misses, pc->dl_late);
+  }
+
+  if (pc->locks_init) {
+    pthread_mutex_lock(&pc->lock);
+    pc->exiting = 1;
+    pthread_cond_broadcast(&pc->job_cond);
+    pthread_mutex_unlock(&pc->lock);
+
+    for (int i = 0; i < pc->nb_threads; i++) {
+      pthread_join(pc->workers[i].thread, NULL);
+    }
+
+    if (pc->la_running) {
+      pthread_join(pc->la_thread, NULL);
+    }
+
+    if (pc->dl_running) {
+      pthread_join(pc->dl_thread, NULL);
+    }
+
+    pthread_cond_destroy(&pc->done_cond);
+    pthread_cond_destroy(&pc->job_cond);
+    pthread_mutex_destroy(&pc->lock);
+  }
+
+  if (pc->trace) {
+    close_trace(ctx);
+  }
+
+  if (pc->handle) {
+    for (int i = 1; i < pc->nb_workers_init; i++) {
+      pc->filter_uninit(pc->workers[i].user_data);
+    }
+
+    if (unref_shared(pc) && pc->filter_uninit) {
+      pc->filter_uninit(pc->user_data);
+    }
+
+    dlclose(pc->handle);
+  }
+
+  if (pc->host_ref) {
+    host_unref();
+  }
+  host_enter(NULL, 0);
+
+  for (int i = 0; i < pc->nb_pending; i++) {
+    av_frame_free(&pc->pending[(pc->pending_head + i) % MAX_DEPTH].frame);
+  }
+  pc->nb_pending = 0;
+
+  for (int i = 0; i < pc->nb_la; i++) {
+    av_frame_free(&pc->la[(pc->la_head + i) % MAX_DEPTH].frame);
+  }
+  pc->nb_la = 0;
+
+  // A late render in blend mode is into the back scratch frame.
+  if (!pc->blend) {
+    av_frame_free(&pc->dl_frame);
+  }
+
+  for (int i = 0; i < pc->nb_scaled; i++) {
+    av_freep(&pc->scaled[i].xmap);
+    av_frame_free(&pc->scaled[i].last);
+  }
+
+  av_freep(&pc->workers);
+  av_freep(&pc->slice_rc);
+  av_frame_free(&pc->canvas[0]);
+  av_frame_free(&pc->canvas[1]);
+  av_frame_free(&pc->scratch[0]);
+  av_frame_free(&pc->bbox_view);
+  av_frame_free(&pc->scratch[1]);
+  av_frame_free(&pc->last_out);
+  av_frame_free(&pc->spare);
+  av_buffer_pool_uninit(&pc->pool);
+
+  if (pc->ring) {
+    shm_ring_unref(pc->ring);
+    pc->ring = NULL;
+  }
+
+  if (pc->memfd >= 0) {
+    close(pc->memfd);
+  }
+
+  if (pc->sock >= 0) {
+    close(pc->sock);
+  }
+}
+
+static void clear_area(AVFrame* out, int x, int y, int w, int h) {
+  int x_end = FFMIN(x + w, out->width);
+  int y_end = FFMIN(y + h, out->height);
+  x = FFMAX(x, 0);
+  y = FFMAX(y, 0);
+  w = x_end - x;
+  if (w <= 0 || y_end <= y) {
+    return;
+  }
+
+  uint8_t* dst = out->data[0] + y * out->linesize[0] + x * 4;
+  if (w == out->width && out->linesize[0] > 0) {
+    memset(dst, 0, (y_end - y - 1) * out->linesize[0] + w * 4);
+    return;
+  }
+
+  for (int i = y; i < y_end; i++) {
+    memset(dst, 0, w * 4);
+    dst += out->linesize[0];
+  }
+}
+
+static void copy_area(AVFrame* dst,
+                      const AVFrame* src,
+                      int x,
+                      int y,
+                      int w,
+                      int h) {
+  int x_end = FFMIN(x + w, dst->width);
+  int y_end = FFMIN(y + h, dst->height);
+  x = FFMAX(x, 0);
+  y = FFMAX(y, 0);
+  if (x_end <= x || y_end <= y) {
+    return;
+  }
+
+  av_image_copy_plane(dst->data[0] + y * dst->linesize[0] + x * 4,
+                      dst->linesize[0],
+                      src->data[0] + y * src->linesize[0] + x * 4,
+                      src->linesize[0], (x_end - x) * 4, y_end - y);
+}
+
+static void clear_image(ProxyContext* pc,
+                        AVFrame* out,
+                        int y_start,
+                        int y_end) {
+  if (pc->clear_rect) {
+    int y = FFMAX(y_start, pc->clear_y);
+    int h = FFMIN(y_end, pc->clear_y + pc->clear_h) - y;
+    clear_area(out, pc->clear_x, y, pc->clear_w, h);
+  } else {
+    clear_area(out, 0, y_start, out->width, y_end - y_start);
+  }
+}
+
+static void init_blend_coeffs(BlendCoeffs* c, const AVFrame* frame, int depth) {
+  double kr = 0.2126, kb = 0.0722;
+  switch (frame->colorspace) {
+    case AVCOL_SPC_BT709:
+      break;
+    case AVCOL_SPC_BT470BG:
+    case AVCOL_SPC_SMPTE170M:
+      kr = 0.299;
+      kb = 0.114;
+      break;
+    case AVCOL_SPC_BT2020_NCL:
+    case AVCOL_SPC_BT2020_CL:
+      kr = 0.2627;
+      kb = 0.0593;
+      break;
+    default:
+      if (frame->height <= 576) {
+        kr = 0.299;
+        kb = 0.114;
+      }
+  }
+
+  double kg = 1 - kr - kb;
+  int full = frame->color_range == AVCOL_RANGE_JPEG ||
+             frame->format == AV_PIX_FMT_YUVJ420P ||
+             frame->format == AV_PIX_FMT_YUVJ422P ||
+             frame->format == AV_PIX_FMT_YUVJ444P;
+  double max = (1 << depth) - 1;
+  double ys = (full ? max : 219 << (depth - 8)) / 255 * 65536;
+  double cs = (full ? max : 224 << (depth - 8)) / 255 * 65536;
+
+  c->y[0] = lrint(kr * ys);
+  c->y[1] = lrint(kg * ys);
+  c->y[2] = lrint(kb * ys);
+  c->u[0] = lrint(-kr / (2 * (1 - kb)) * cs);
+  c->u[1] = lrint(-kg / (2 * (1 - kb)) * cs);
+  c->u[2] = lrint(0.5 * cs);
+  c->v[0] = lrint(0.5 * cs);
+  c->v[1] = lrint(-kg / (2 * (1 - kr)) * cs);
+  c->v[2] = lrint(-kb / (2 * (1 - kr)) * cs);
+  c->y_offset = ((full ? 0 : 16 << (depth - 8)) << 16) + (1 << 15);
+  c->c_offset = ((128 << (depth - 8)) << 16) + (1 << 15);
+  c->max = (1 << depth) - 1;
+}
+
+#define BLEND(d, s, a) (((s) * (a) + (d) * (255 - (a)) + 127) / 255)
+
+#define DEFINE_BLEND(bits, type)                                              \
+  static void blend_rows_##bits(const BlendCoeffs* c, const AVFrame* src,     \
+                                AVFrame* dst, int dx, int dy, int hsub,       \
+                                int vsub, int y_start, int y_end) {           \
+    int w = FFMIN(src->width, dst->width - dx);                               \
+                                                                              \
+    for (int y = y_start; y < y_end; y++) {                                   \
+      const uint8_t* s = src->data[0] + y * src->linesize[0];                 \
+      type* d = (type*)(dst->data[0] + (y + dy) * dst->linesize[0]) + dx;     \
+      for (int x = 0; x < w; x += 4) {                                        \
+        int n = FFMIN(4, w - x);                                              \
+        if (n == 4 && !(s[4 * x + 3] | s[4 * x + 7] | s[4 * x + 11] |         \
+                        s[4 * x + 15])) {                                     \
+          continue;                                                           \
+        }                                                                     \
+                                                                              \
+        for (int i = x; i < x + n; i++) {                                     \
+          const uint8_t* p = s + 4 * i;                                       \
+          int a = p[3];                                                       \
+          if (!a) {                                                           \
+            continue;                                                         \
+          }                                                                   \
+                                                                              \
+          int yv = (c->y[0] * p[2] + c->y[1] * p[1] + c->y[2] * p[0] +        \
+                    c->y_offset) >> 16;                                       \
+          d[i] = BLEND(d[i], yv, a);                                          \
+        }                                                                     \
+      }                                                                       \
+    }                                                                         \
+                                                                              \
+    int cw = AV_CEIL_RSHIFT(w, hsub);                                         \
+    for (int cy = y_start >> vsub; cy < AV_CEIL_RSHIFT(y_end, vsub); cy++) {  \
+      int dcx = dx >> hsub, dcy = cy + (dy >> vsub);                          \
+      type* du = (type*)(dst->data[1] + dcy * dst->linesize[1]) + dcx;        \
+      type* dv = (type*)(dst->data[2] + dcy * dst->linesize[2]) + dcx;        \
+      int y0 = cy << vsub;                                                    \
+      int y1 = FFMIN((cy + 1) << vsub, y_end);                                \
+      for (int cx = 0; cx < cw; cx++) {                                       \
+        int x0 = cx << hsub;                                                  \
+        int x1 = FFMIN((cx + 1) << hsub, w);                                  \
+        int sa = 0, sr = 0, sg = 0, sb = 0;                                   \
+        for (int y = y0; y < y1; y++) {                                       \
+          const uint8_t* p = src->data[0] + y * src->linesize[0] + 4 * x0;    \
+          for (int x = x0; x < x1; x++, p += 4) {                             \
+            sa += p[3];                                                       \
+            sr += p[2] * p[3];                                                \
+            sg += p[1] * p[3];                                                \
+            sb += p[0] * p[3];                                                \
+          }                                                                   \
+        }                                                                     \
+                                                                              \
+        if (!sa) {                                                            \
+          continue;                                                           \
+        }                                                                     \
+                                                                              \
+        int n = (x1 - x0) * (y1 - y0);                                        \
+        int a = (sa + n / 2) / n;                                             \
+        int r = sr / sa, g = sg / sa, b = sb / sa;                            \
+        int uv = (c->u[0] * r + c->u[1] * g + c->u[2] * b + c->c_offset) >>  \
+                 16;                                                          \
+        int vv = (c->v[0] * r + c->v[1] * g + c->v[2] * b + c->c_offset) >>  \
+                 16;                                                          \
+        du[cx] = BLEND(du[cx], FFMIN(uv, c->max), a);                         \
+        dv[cx] = BLEND(dv[cx], FFMIN(vv, c->max), a);                         \
+      }                                                                       \
+    }                                                                         \
+  }
+
+DEFINE_BLEND(8, uint8_t)
+DEFINE_BLEND(16, uint16_t)
+
+static int blend_slice(AVFilterContext* ctx,
+                       void* arg,
+                       int jobnr,
+                       int nb_jobs) {
+  ProxyContext* pc = ctx->priv;
+  ThreadData* td = arg;
+  AVFrame* dst = td->frame;
+
+  int h = FFMIN(td->overlay->height, dst->height - td->y);
+  int rows = AV_CEIL_RSHIFT(h, pc->vsub);
+  int y_start = (rows * jobnr / nb_jobs) << pc->vsub;
+  int y_end = FFMIN((rows * (jobnr + 1) / nb_jobs) << pc->vsub, h);
+
+  if (pc->blend_depth > 8) {
+    blend_rows_16(&pc->coeffs, td->overlay, dst, td->x, td->y, pc->hsub,
+                  pc->vsub, y_start, y_end);
+  } else {
+    blend_rows_8(&pc->coeffs, td->overlay, dst, td->x, td->y, pc->hsub,
+                 pc->vsub, y_start, y_end);
+  }
+
+  return 0;
+}
+
+static int render_slice(AVFilterContext* ctx,
+                        void* arg,
+                        int jobnr,
+                        int nb_jobs) {
+  ProxyContext* pc = ctx->priv;
+  ThreadData* td = arg;
+  AVFrame* out = td->frame;
+
+  if (!host_graph_thread) {
+    host_enter(ctx, 0);
+  }
+
+  int y_start = (out->height * jobnr) / nb_jobs;
+  int y_end = (out->height * (jobnr + 1)) / nb_jobs;
+
+  if (td->clear) {
+    clear_image(pc, out, y_start, y_end);
+  }
+
+  return pc->filter_slice(out->data[0], out->linesize[0], out->width,
+                          out->height, y_start, y_end, td->ts_millis,
+                          pc->user_data);
+}
+
+static int render_slices(AVFilterContext* ctx,
+                         AVFrame* out,
+                         double time_ms,
+                         int clear) {
+  ProxyContext* pc = ctx->priv;
+  ThreadData td = {.frame = out, .ts_millis = time_ms, .clear = clear};
+  int nb_jobs = FFMIN(out->height, pc->nb_slices);
+
+  host_graph_thread = 0;
+  ff_filter_execute(ctx, render_slice, &td, pc->slice_rc, nb_jobs);
+  host_graph_thread = 1;
+
+  int nb_unchanged = 0;
+  for (int i = 0; i < nb_jobs; i++) {
+    if (pc->slice_rc[i] == FRAME_UNCHANGED) {
+      nb_unchanged++;
+    } else if (pc->slice_rc[i] != 0) {
+      return pc->slice_rc[i];
+    }
+  }
+
+  if (nb_unchanged > 0 && nb_unchanged < nb_jobs) {
+    av_log(ctx, AV_LOG_ERROR, "only some slices were unchanged\n");
+    return AVERROR_EXTERNAL;
+  }
+
+  return nb_unchanged ? FRAME_UNCHANGED : 0;
+}
+
+static int render_frame(AVFilterContext* ctx,
+                        AVFrame* out,
+                        unsigned int data_size,
+                        double time_ms,
+                        int clear) {
+  ProxyContext* pc = ctx->priv;
+
+  if (pc->filter_slice && av_pix_fmt_count_planes(out->format) == 1) {
+    int64_t start = av_gettime_relative();
+    int rc = render_slices(ctx, out, time_ms, clear);
+    add_timing(pc->timings, STAGE_RENDER, start);
+    return rc;
+  }
+
+  if (clear) {
+    int64_t start = av_gettime_relative();
+    clear_image(pc, out, 0, out->height);
+    add_timing(pc->timings, STAGE_CLEAR, start);
+  }
+
+  int64_t start = av_gettime_relative();
+  int rc = call_filter_frame(pc, out, data_size, time_ms, 0, pc->user_data);
+  add_timing(pc->timings, STAGE_RENDER, start);
+
+  return rc;
+}
+
+static int render_damage(AVFilterContext* ctx,
+                         AVFrame* canvas,
+                         unsigned int data_size,
+                         double time_ms) {
+  ProxyContext* pc = ctx->priv;
+  int rects[4 * MAX_RECTS];
+  int nb_rects = 0;
+
+  int rc = pc->filter_damage(time_ms, rects, MAX_RECTS, &nb_rects,
+                             pc->user_data);
+  if (rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "filter_damage returned: %d\n", rc);
+    return AVERROR_EXTERNAL;
+  }
+
+  nb_rects = av_clip(nb_rects, 0, MAX_RECTS);
+  memcpy(pc->damage, rects, 4 * nb_rects * sizeof(*rects));
+  pc->nb_damage = nb_rects;
+  if (nb_rects == 0) {
+    return 0;
+  }
+
+  int64_t start = av_gettime_relative();
+  for (int i = 0; i < nb_rects; i++) {
+    int* r = &rects[4 * i];
+    clear_area(canvas, r[0], r[1], r[2], r[3]);
+  }
+  add_timing(pc->timings, STAGE_CLEAR, start);
+
+  return render_frame(ctx, canvas, data_size, time_ms, 0);
+}
+
+static int render_canvas(AVFilterContext* ctx,
+                         AVFrame* canvas,
+                         int redraw,
+                         unsigned int data_size,
+                         double time_ms) {
+  ProxyContext* pc = ctx->priv;
+
+  if (redraw || !pc->filter_damage) {
+    pc->nb_damage = -1;
+    return render_frame(ctx, canvas, data_size, time_ms, 1);
+  }
+
+  return render_damage(ctx, canvas, data_size, time_ms);
+}
+
+static int row_has_alpha(const uint8_t* row, int w) {
+  uint32_t acc = 0;
+  for (int x = 0; x < w; x++) {
+    acc |= AV_RL32(row + 4 * x);
+  }
+  return acc >> 24;
+}
+
+// Finds the bounding box of the pixels with nonzero alpha in a BGRA frame.
+// Empty rows are skipped a whole row at a time and only the columns outside
+// the box found so far are looked at in the others.
+static void scan_alpha(ProxyContext* pc, const AVFrame* frame) {
+  const uint8_t* data = frame->data[0];
+  int line_size = frame->linesize[0];
+  int w = frame->width;
+  int h = frame->height;
+
+  pc->bbox_valid = frame->format == AV_PIX_FMT_BGRA;
+  if (!pc->bbox_valid) {
+    return;
+  }
+
+  int top = 0;
+  while (top < h && !row_has_alpha(data + top * line_size, w)) {
+    top++;
+  }
+
+  pc->transparent = top == h;
+  if (pc->transparent) {
+    return;
+  }
+
+  int bottom = h - 1;
+  while (!row_has_alpha(data + bottom * line_size, w)) {
+    bottom--;
+  }
+
+  int left = w, right = -1;
+  for (int y = top; y <= bottom; y++) {
+    const uint8_t* p = data + y * line_size;
+    for (int x = 0; x < left; x++) {
+      if (p[4 * x + 3]) {
+        left = x;
+        break;
+      }
+    }
+    for (int x = w - 1; x > right; x--) {
+      if (p[4 * x + 3]) {
+        right = x;
+        break;
+      }
+    }
+  }
+
+  pc->bbox[0] = left;
+  pc->bbox[1] = top;
+  pc->bbox[2] = right - left + 1;
+  pc->bbox[3] = bottom - top + 1;
+}
+
+// Box filters a BGRA frame down, weighting the colors by alpha so that
+// transparent pixels don't darken the edges of the graphics.
+static int scale_slice(AVFilterContext* ctx,
+                       void* arg,
+                       int jobnr,
+                       int nb_jobs) {
+  ThreadData* td = arg;
+  const AVFrame* src = td->overlay;
+  AVFrame* dst = td->frame;
+  const int* xmap = td->xmap;
+
+  int y_start = (dst->height * jobnr) / nb_jobs;
+  int y_end = (dst->height * (jobnr + 1)) / nb_jobs;
+
+  for (int y = y_start; y < y_end; y++) {
+    int y0 = (int64_t)y * src->height / dst->height;
+    int y1 = (int64_t)(y + 1) * src->height / dst->height;
+    uint8_t* d = dst->data[0] + y * dst->linesize[0];
+
+    for (int x = 0; x < dst->width; x++) {
+      uint64_t b = 0, g = 0, r = 0, a = 0;
+      for (int sy = y0; sy < y1; sy++) {
+        const uint8_t* p = src->data[0] + sy * src->linesize[0];
+        for (int sx = xmap[x]; sx < xmap[x + 1]; sx++) {
+          const uint8_t* q = p + 4 * sx;
+          b += q[0] * q[3];
+          g += q[1] * q[3];
+          r += q[2] * q[3];
+          a += q[3];
+        }
+      }
+
+      uint64_t n = (uint64_t)(y1 - y0) * (xmap[x + 1] - xmap[x]);
+      if (a) {
+        d[4 * x + 0] = (b + a / 2) / a;
+        d[4 * x + 1] = (g + a / 2) / a;
+        d[4 * x + 2] = (r + a / 2) / a;
+      } else {
+        d[4 * x + 0] = d[4 * x + 1] = d[4 * x + 2] = 0;
+      }
+      d[4 * x + 3] = (a + n / 2) / n;
+    }
+  }
+
+  return 0;
+}
+
+// Passes the frame on to the extra outputs, scaled down once per output
+// unless it's the last frame again.
+static int send_scaled(AVFilterContext* ctx, AVFrame* out) {
+  ProxyContext* pc = ctx->priv;
+  int reuse = pc->scaled_reuse;
+  int scaled = 0;
+
+  pc->scaled_reuse = 0;
+
+  int64_t start = av_gettime_relative();
+  for (int i = 0; i < pc->nb_scaled; i++) {
+    ScaledOutput* so = &pc->scaled[i];
+    AVFilterLink* outlink = ctx->outputs[i + 1];
+    if (ff_outlink_get_status(outlink) || (reuse && so->last)) {
+      continue;
+    }
+
+    av_frame_free(&so->last);
+    so->last = ff_get_video_buffer(outlink, outlink->w, outlink->h);
+    if (!so->last) {
+      return AVERROR(ENOMEM);
+    }
+
+    ThreadData td = {.frame = so->last, .overlay = out, .xmap = so->xmap};
+    ff_filter_execute(ctx, scale_slice, &td, NULL,
+                      FFMIN(outlink->h, ff_filter_get_nb_threads(ctx)));
+    scaled = 1;
+  }
+
+  if (scaled) {
+    int64_t end = av_gettime_relative();
+    av_dict_set_int(&out->metadata, stage_keys[STAGE_SCALE], end - start, 0);
+    hist_add(&pc->hist[STAGE_SCALE], end - start);
+    if (trace_buf) {
+      trace_add(STAGE_SCALE, start, end);
+    }
+  }
+
+  for (int i = 0; i < pc->nb_scaled; i++) {
+    AVFilterLink* outlink = ctx->outputs[i + 1];
+    if (ff_outlink_get_status(outlink)) {
+      continue;
+    }
+
+    AVFrame* frame = av_frame_clone(pc->scaled[i].last);
+    if (!frame) {
+      return AVERROR(ENOMEM);
+    }
+
+    int ret = av_frame_copy_props(frame, out);
+    if (ret < 0) {
+      av_frame_free(&frame);
+      return ret;
+    }
+    frame->sample_aspect_ratio = outlink->sample_aspect_ratio;
+
+    if ((ret = ff_filter_frame(outlink, frame)) < 0) {
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+static int send_frame(AVFilterContext* ctx,
+                      AVFrame* out,
+                      const int64_t* timings) {
+  ProxyContext* pc = ctx->priv;
+
+  for (int i = 0; i < STAGE_PUSH; i++) {
+    if (timings[i] >= 0) {
+      av_dict_set_int(&out->metadata, stage_keys[i], timings[i], 0);
+      hist_add(&pc->hist[i], timings[i]);
+    }
+  }
+
+  if (pc->nb_scaled) {
+    int ret = send_scaled(ctx, out);
+    if (ret < 0) {
+      av_frame_free(&out);
+      return ret;
+    }
+
+    if (ff_outlink_get_status(ctx->outputs[0])) {
+      av_frame_free(&out);
+      return 0;
+    }
+  }
+
+  if (pc->region && !pc->blend) {
+    av_dict_set_int(&out->metadata, "lavfi.proxy.x", pc->render_x, 0);
+    av_dict_set_int(&out->metadata, "lavfi.proxy.y", pc->render_y, 0);
+  }
+
+  if (pc->alpha_bbox && !pc->blend && pc->bbox_valid) {
+    if (pc->transparent) {
+      av_dict_set(&out->metadata, "lavfi.proxy.transparent", "1", 0);
+    } else {
+      av_dict_set_int(&out->metadata, "lavfi.proxy.bbox_x", pc->bbox[0], 0);
+      av_dict_set_int(&out->metadata, "lavfi.proxy.bbox_y", pc->bbox[1], 0);
+      av_dict_set_int(&out->metadata, "lavfi.proxy.bbox_w", pc->bbox[2], 0);
+      av_dict_set_int(&out->metadata, "lavfi.proxy.bbox_h", pc->bbox[3], 0);
+    }
+  }
+
+  frame_pts = out->pts;
+  int64_t start = av_gettime_relative();
+  int ret = ff_filter_frame(ctx->outputs[0], out);
+  int64_t end = av_gettime_relative();
+  hist_add(&pc->hist[STAGE_PUSH], end - start);
+  if (trace_buf) {
+    trace_add(STAGE_PUSH, start, end);
+  }
+
+  return ret;
+}
+
+static int push_frame(AVFilterContext* ctx,
+                      AVFrame* out,
+                      const int64_t* timings) {
+  ProxyContext* pc = ctx->priv;
+
+  if (pc->alpha_bbox) {
+    scan_alpha(pc, out);
+  }
+
+  if (!pc->keep_last) {
+    return send_frame(ctx, out, timings);
+  }
+
+  if (!pc->last_out && !(pc->last_out = av_frame_alloc())) {
+    av_frame_free(&out);
+    return AVERROR(ENOMEM);
+  }
+
+  av_frame_unref(pc->last_out);
+  int ret = av_frame_ref(pc->last_out, out);
+  if (ret < 0) {
+    av_frame_free(&out);
+    return ret;
+  }
+
+  return send_frame(ctx, out, timings);
+}
+
+static int push_unchanged(AVFilterContext* ctx,
+                          const AVFrame* props,
+                          const int64_t* timings) {
+  ProxyContext* pc = ctx->priv;
+
+  if (!pc->keep_last) {
+    av_log(ctx, AV_LOG_ERROR,
+           "unchanged frames need clear without clear_rect and "
+           "PROXY_CAP_UNCHANGED\n");
+    return AVERROR_EXTERNAL;
+  }
+
+  if (!pc->last_out) {
+    av_log(ctx, AV_LOG_ERROR, "unchanged frame without a previous frame\n");
+    return AVERROR_EXTERNAL;
+  }
+
+  AVFrame* out = av_frame_clone(pc->last_out);
+  if (!out) {
+    return AVERROR(ENOMEM);
+  }
+
+  int ret = av_frame_copy_props(out, props);
+  if (ret < 0) {
+    av_frame_free(&out);
+    return ret;
+  }
+
+  pc->scaled_reuse = 1;
+  return send_frame(ctx, out, timings);
+}
+
+// Returns nonzero if the frame is on the same render_rate tick as the last
+// render, which can then be passed on again. Otherwise the frame starts a new
+// tick which is rendered at its start time.
+static int same_tick(AVFilterContext* ctx, const AVFrame* in, double* time_ms) {
+  ProxyContext* pc = ctx->priv;
+
+  if (!pc->render_rate.num || in->pts == AV_NOPTS_VALUE) {
+    return 0;
+  }
+
+  AVRational tick_base = av_inv_q(pc->render_rate);
+  int64_t tick = av_rescale_q_rnd(in->pts, ctx->inputs[0]->time_base,
+                                  tick_base, AV_ROUND_DOWN);
+  if (pc->has_tick && tick == pc->tick) {
+    return 1;
+  }
+
+  pc->tick = tick;
+  pc->has_tick = 1;
+  *time_ms = tick * av_q2d(tick_base) * 1000;
+
+  return 0;
+}
+
+static void* deadline_thread(void* arg) {
+  AVFilterContext* ctx = arg;
+  ProxyContext* pc = ctx->priv;
+
+  host_enter(ctx, 0);
+  place_thread(ctx);
+  if (pc->trace) {
+    trace_buf = trace_new(pc, "proxy deadline");
+  }
+
+  pthread_mutex_lock(&pc->lock);
+  for (;;) {
+    while (!pc->exiting && pc->dl_state != DEADLINE_PENDING) {
+      pthread_cond_wait(&pc->job_cond, &pc->lock);
+    }
+
+    if (pc->exiting) {
+      break;
+    }
+
+    AVFrame* frame = pc->dl_frame;
+    unsigned int data_size = pc->dl_data_size;
+    double time_ms = pc->dl_ts_millis;
+    frame_pts = pc->dl_pts;
+    frame_index = pc->dl_index;
+    pthread_mutex_unlock(&pc->lock);
+
+    int64_t timings[NB_STAGES];
+    for (int i = 0; i < NB_STAGES; i++) {
+      timings[i] = -1;
+    }
+
+    int64_t start = av_gettime_relative();
+    clear_image(pc, frame, 0, frame->height);
+    add_timing(timings, STAGE_CLEAR, start);
+
+    start = av_gettime_relative();
+    int rc =
+        call_filter_frame(pc, frame, data_size, time_ms, 0, pc->user_data);
+    add_timing(timings, STAGE_RENDER, start);
+
+    pthread_mutex_lock(&pc->lock);
+    pc->dl_rc = rc;
+    memcpy(pc->dl_timings, timings, sizeof(timings));
+    pc->dl_state = DEADLINE_DONE;
+    pthread_cond_broadcast(&pc->done_cond);
+  }
+  pthread_mutex_unlock(&pc->lock);
+
+  return NULL;
+}
+
+// Collects a render that finished after its deadline into late, and returns
+// nonzero if the deadline thread is free to take the next frame.
+static int deadline_idle(ProxyContext* pc, AVFrame** late, int* late_rc) {
+  *late = NULL;
+
+  pthread_mutex_lock(&pc->lock);
+  if (pc->dl_state == DEADLINE_DONE) {
+    *late = pc->dl_frame;
+    *late_rc = pc->dl_rc;
+    pc->dl_frame = NULL;
+    pc->dl_state = DEADLINE_IDLE;
+    pc->dl_late++;
+  }
+
+  int idle = pc->dl_state == DEADLINE_IDLE;
+  if (!idle) {
+    pc->dl_misses++;
+  }
+  pthread_mutex_unlock(&pc->lock);
+
+  return idle;
+}
+
+// Renders into frame on the deadline thread. If that takes longer than
+// deadline_ms, DEADLINE_MISSED is returned and the frame is kept by the
+// thread until deadline_idle hands it back.
+static int deadline_render(AVFilterContext* ctx,
+                           AVFrame* frame,
+                           unsigned int data_size,
+                           double time_ms) {
+  ProxyContext* pc = ctx->priv;
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += pc->deadline_ms / 1000;
+  deadline.tv_nsec += (pc->deadline_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&pc->lock);
+  pc->dl_frame = frame;
+  pc->dl_data_size = data_size;
+  pc->dl_ts_millis = time_ms;
+  pc->dl_pts = frame_pts;
+  pc->dl_index = frame_index;
+  pc->dl_state = DEADLINE_PENDING;
+  pthread_cond_signal(&pc->job_cond);
+
+  int ret = 0;
+  while (pc->dl_state != DEADLINE_DONE && ret != ETIMEDOUT) {
+    ret = pthread_cond_timedwait(&pc->done_cond, &pc->lock, &deadline);
+  }
+
+  int rc = DEADLINE_MISSED;
+  if (pc->dl_state == DEADLINE_DONE) {
+    rc = pc->dl_rc;
+    for (int i = STAGE_CLEAR; i <= STAGE_RENDER; i++) {
+      pc->timings[i] = pc->dl_timings[i];
+    }
+    pc->dl_frame = NULL;
+    pc->dl_state = DEADLINE_IDLE;
+  } else {
+    pc->dl_misses++;
+  }
+  pthread_mutex_unlock(&pc->lock);
+
+  return rc;
+}
+
+// Renders the next overlay into the back scratch frame, which is swapped in
+// when it's done, whether in time or later. The front one is blended again
+// until then.
+static int render_overlay_deadline(AVFilterContext* ctx,
+                                   double time_ms,
+                                   int* changed) {
+  ProxyContext* pc = ctx->priv;
+  AVFrame* late;
+  int late_rc = 0;
+
+  *changed = 0;
+  int idle = deadline_idle(pc, &late, &late_rc);
+  if (late && late_rc == 0) {
+    FFSWAP(AVFrame*, pc->scratch[0], pc->scratch[1]);
+    *changed = 1;
+  } else if (late && late_rc != FRAME_UNCHANGED) {
+    return late_rc;
+  }
+
+  if (!idle) {
+    return DEADLINE_MISSED;
+  }
+
+  int rc = deadline_render(ctx, pc->scratch[1], pc->scratch_size, time_ms);
+  if (rc == 0) {
+    FFSWAP(AVFrame*, pc->scratch[0], pc->scratch[1]);
+    *changed = 1;
+  } else if (rc == FRAME_UNCHANGED) {
+    rc = 0;
+  }
+
+  return rc;
+}
+
+static int filter_frame_blend(AVFilterContext* ctx,
+                              AVFrame* in,
+                              double time_ms) {
+  ProxyContext* pc = ctx->priv;
+
+  int rc = 0, changed = 1;
+  if (same_tick(ctx, in, &time_ms) && pc->scratch_rendered) {
+    changed = 0;
+  } else if (pc->deadline_ms) {
+    rc = render_overlay_deadline(ctx, time_ms, &changed);
+    if (rc == DEADLINE_MISSED) {
+      av_dict_set(&in->metadata, "lavfi.proxy.deadline_missed", "1", 0);
+      rc = 0;
+    }
+  } else if (pc->filter_damage) {
+    rc = render_canvas(ctx, pc->scratch[0], !pc->scratch_rendered,
+                       pc->scratch_size, time_ms);
+  } else {
+    rc = render_frame(ctx, pc->scratch[1], pc->scratch_size, time_ms,
+                      !pc->back_clean);
+    pc->back_clean = 0;
+    if (rc == FRAME_UNCHANGED && pc->scratch_rendered) {
+      pc->back_clean = 1;
+      changed = 0;
+      rc = 0;
+    } else if (rc == 0) {
+      FFSWAP(AVFrame*, pc->scratch[0], pc->scratch[1]);
+    }
+  }
+
+  // A failed filter_damage has been logged already.
+  if (rc == AVERROR_EXTERNAL) {
+    av_frame_free(&in);
+    return rc;
+  }
+
+  if (rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "filter_frame returned: %d\n", rc);
+    av_frame_free(&in);
+    return AVERROR_UNKNOWN;
+  }
+
+  // Nothing has been rendered in time yet.
+  if (!changed && !pc->scratch_rendered) {
+    return send_frame(ctx, in, pc->timings);
+  }
+  pc->scratch_rendered = 1;
+
+  ThreadData td = {
+      .frame = in,
+      .overlay = pc->scratch[0],
+      .x = pc->render_x,
+      .y = pc->render_y,
+  };
+
+  // Only the bounding box of the overlay, widened to whole chroma samples,
+  // is blended, and nothing at all if it's fully transparent.
+  if (pc->alpha_bbox) {
+    if (changed) {
+      scan_alpha(pc, pc->scratch[0]);
+    }
+
+    if (pc->transparent) {
+      return send_frame(ctx, in, pc->timings);
+    }
+
+    AVFrame* view = pc->bbox_view;
+    if (!view && !(view = pc->bbox_view = av_frame_alloc())) {
+      av_frame_free(&in);
+      return AVERROR(ENOMEM);
+    }
+
+    int x = pc->bbox[0] & ~((1 << pc->hsub) - 1);
+    int y = pc->bbox[1] & ~((1 << pc->vsub) - 1);
+    av_frame_unref(view);
+    int ret = av_frame_ref(view, pc->scratch[0]);
+    if (ret < 0) {
+      av_frame_free(&in);
+      return ret;
+    }
+
+    view->crop_left = x;
+    view->crop_top = y;
+    int right = FFMIN(FFALIGN(pc->bbox[0] + pc->bbox[2], 1 << pc->hsub),
+                      view->width);
+    int bottom = FFMIN(FFALIGN(pc->bbox[1] + pc->bbox[3], 1 << pc->vsub),
+                       view->height);
+    view->crop_right = view->width - right;
+    view->crop_bottom = view->height - bottom;
+    if ((ret = av_frame_apply_cropping(view, AV_FRAME_CROP_UNALIGNED)) < 0) {
+      av_frame_free(&in);
+      return ret;
+    }
+
+    td.overlay = view;
+    td.x += x;
+    td.y += y;
+  }
+
+  init_blend_coeffs(&pc->coeffs, in, pc->blend_depth);
+
+  int64_t start = av_gettime_relative();
+  int h = FFMIN(td.overlay->height, in->height - td.y);
+  int rows = AV_CEIL_RSHIFT(h, pc->vsub);
+  ff_filter_execute(ctx, blend_slice, &td, NULL,
+                    FFMIN(rows, ff_filter_get_nb_threads(ctx)));
+  add_timing(pc->timings, STAGE_BLEND, start);
+
+  return send_frame(ctx, in, pc->timings);
+}
+
+// The canvas is double buffered, so that the frame rendered into is usually
+// not the one still held downstream. The other canvas is one frame behind and
+// is brought up to date by copying the areas damaged in the last frame.
+static int filter_frame_canvas(AVFilterContext* ctx,
+                               AVFrame* in,
+                               unsigned int data_size,
+                               double time_ms) {
+  AVFilterLink* outlink = ctx->outputs[0];
+  ProxyContext* pc = ctx->priv;
+  int ret, rc;
+
+  FFSWAP(AVFrame*, pc->canvas[0], pc->canvas[1]);
+  AVFrame* front = pc->canvas[1];
+
+  if (!pc->canvas[0]) {
+    pc->canvas[0] = ff_get_video_buffer(outlink, outlink->w, outlink->h);
+    if (!pc->canvas[0]) {
+      av_frame_free(&in);
+      return AVERROR(ENOMEM);
+    }
+  }
+
+  if (!front) {
+    rc = render_canvas(ctx, pc->canvas[0], 1, data_size, time_ms);
+  } else if ((ret = av_frame_make_writable(pc->canvas[0])) < 0 ||
+             (pc->nb_damage < 0 &&
+              (ret = av_frame_copy(pc->canvas[0], front)) < 0)) {
+    av_frame_free(&in);
+    return ret;
+  } else {
+    int64_t start = av_gettime_relative();
+    for (int i = 0; i < pc->nb_damage; i++) {
+      const int* r = &pc->damage[4 * i];
+      copy_area(pc->canvas[0], front, r[0], r[1], r[2], r[3]);
+    }
+    add_timing(pc->timings, STAGE_WRITABLE, start);
+
+    rc = render_canvas(ctx, pc->canvas[0], 0, data_size, time_ms);
+  }
+
+  // A failed filter_damage has been logged already.
+  if (rc == AVERROR_EXTERNAL) {
+    av_frame_free(&in);
+    return rc;
+  }
+
+  if (rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "filter_frame returned: %d\n", rc);
+    av_frame_free(&in);
+    return AVERROR_UNKNOWN;
+  }
+
+  AVFrame* out = av_frame_alloc();
+  if (!out) {
+    av_frame_free(&in);
+    return AVERROR(ENOMEM);
+  }
+
+  if ((ret = av_frame_ref(out, pc->canvas[0])) < 0 ||
+      (ret = av_frame_copy_props(out, in)) < 0) {
+    av_frame_free(&out);
+    av_frame_free(&in);
+    return ret;
+  }
+
+  av_frame_free(&in);
+  return push_frame(ctx, out, pc->timings);
+}
+
+static int receive_async(AVFilterContext* ctx, int block) {
+  ProxyContext* pc = ctx->priv;
+
+  unsigned char* data = NULL;
+  int rc = pc->filter_receive_frame(&data, block, pc->user_data);
+  if (rc == RECEIVE_AGAIN && !block) {
+    return AVERROR(EAGAIN);
+  }
+
+  if (rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "filter_receive_frame returned: %d\n", rc);
+    return AVERROR_UNKNOWN;
+  }
+
+  for (int i = 0; i < pc->nb_pending; i++) {
+    PendingFrame* p = &pc->pending[(pc->pending_head + i) % MAX_DEPTH];
+    if (!p->done && p->frame->data[0] == data) {
+      p->done = 1;
+      frame_pts = p->frame->pts;
+      add_timing(p->timings, STAGE_RENDER, p->sent);
+      return 0;
+    }
+  }
+
+  av_log(ctx, AV_LOG_ERROR,
+         "filter_receive_frame returned an unknown buffer\n");
+  return AVERROR_EXTERNAL;
+}
+
+static int flush_batch(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+  ProxyFrame frames[MAX_DEPTH];
+  int nb_frames = pc->nb_pending;
+
+  if (!nb_frames) {
+    return 0;
+  }
+
+  for (int i = 0; i < nb_frames; i++) {
+    PendingFrame* p = &pc->pending[(pc->pending_head + i) % MAX_DEPTH];
+    frames[i] = (ProxyFrame){
+        .data = p->frame->data[0],
+        .data_size = p->data_size,
+        .width = p->frame->width,
+        .height = p->frame->height,
+        .line_size = p->frame->linesize[0],
+        .ts_millis = p->ts_millis,
+    };
+  }
+
+  int64_t start = av_gettime_relative();
+  if (trace_buf) {
+    for (int i = 0; i < nb_frames; i++) {
+      PendingFrame* p = &pc->pending[(pc->pending_head + i) % MAX_DEPTH];
+      frame_pts = p->frame->pts;
+      trace_add(TRACE_QUEUE, p->queued, start);
+    }
+  }
+
+  int rc = pc->filter_frames(frames, nb_frames, pc->user_data);
+
+  int ret = 0;
+  for (int i = 0; i < nb_frames; i++) {
+    PendingFrame* p = &pc->pending[pc->pending_head];
+    AVFrame* out = p->frame;
+    int64_t timings[NB_STAGES];
+    memcpy(timings, p->timings, sizeof(timings));
+    frame_pts = out->pts;
+    add_timing(timings, STAGE_RENDER, start);
+    memset(p, 0, sizeof(*p));
+    pc->pending_head = (pc->pending_head + 1) % MAX_DEPTH;
+    pc->nb_pending--;
+
+    if (rc != 0 || ret < 0) {
+      av_frame_free(&out);
+      continue;
+    }
+
+    ret = push_frame(ctx, out, timings);
+  }
+
+  if (rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "filter_frames returned: %d\n", rc);
+    return AVERROR_UNKNOWN;
+  }
+
+  return ret;
+}
+
+// Passes on the frames in flight that are done, waiting for the oldest
+// nb_wait of them and for as many as it takes to get below depth.
+static int receive_frames(AVFilterContext* ctx, int nb_wait) {
+  ProxyContext* pc = ctx->priv;
+
+  if (pc->batch > 1) {
+    return nb_wait ? flush_batch(ctx) : 0;
+  }
+
+  while (pc->nb_pending > 0) {
+    PendingFrame* head = &pc->pending[pc->pending_head];
+    int block = nb_wait > 0 || pc->nb_pending >= pc->depth;
+
+    if (pc->threaded) {
+      pthread_mutex_lock(&pc->lock);
+      while (block && !head->done) {
+        pthread_cond_wait(&pc->done_cond, &pc->lock);
+      }
+      int done = head->done;
+      pthread_mutex_unlock(&pc->lock);
+
+      if (!done) {
+        break;
+      }
+    } else if (!head->done) {
+      int ret = receive_async(ctx, block);
+      if (ret == AVERROR(EAGAIN)) {
+        break;
+      }
+
+      if (ret < 0) {
+        return ret;
+      }
+      continue;
+    }
+
+    AVFrame* out = head->frame;
+    int rc = head->rc;
+    int64_t timings[NB_STAGES];
+    memcpy(timings, head->timings, sizeof(timings));
+    if (pc->threaded) {
+      pthread_mutex_lock(&pc->lock);
+    }
+    memset(head, 0, sizeof(*head));
+    pc->pending_head = (pc->pending_head + 1) % MAX_DEPTH;
+    pc->nb_pending--;
+    nb_wait--;
+    if (pc->threaded) {
+      pthread_mutex_unlock(&pc->lock);
+    }
+
+    if (rc == FRAME_UNCHANGED) {
+      int ret = push_unchanged(ctx, out, timings);
+      av_frame_free(&out);
+      if (ret < 0) {
+        return ret;
+      }
+      continue;
+    }
+
+    if (rc != 0) {
+      av_log(ctx, AV_LOG_ERROR, "filter_frame returned: %d\n", rc);
+      av_frame_free(&out);
+      return AVERROR_UNKNOWN;
+    }
+
+    if (pc->ring) {
+      int ret = shm_detach_frame(ctx, &out);
+      if (ret < 0) {
+        av_frame_free(&out);
+        return ret;
+      }
+    }
+
+    int ret = push_frame(ctx, out, timings);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+// A surface shared with other filters, or held as a reference by an encoder,
+// is copied to a new one from the same pool before it's drawn on.
+static int make_hw_writable(AVFilterContext* ctx, AVFrame** frame) {
+  AVFrame* in = *frame;
+  AVFrame* sw = NULL;
+
+  if (av_frame_is_writable(in)) {
+    return 0;
+  }
+
+  AVFrame* out = av_frame_alloc();
+  if (!out) {
+    return AVERROR(ENOMEM);
+  }
+
+  int ret = av_hwframe_get_buffer(in->hw_frames_ctx, out, 0);
+  if (ret < 0) {
+    av_log(ctx, AV_LOG_ERROR, "error allocating a hardware frame\n");
+    goto end;
+  }
+
+  // Not every hwcontext copies between surfaces, e.g. VAAPI doesn't, so the
+  // frame goes through system memory then.
+  if (av_hwframe_transfer_data(out, in, 0) < 0) {
+    if (!(sw = av_frame_alloc())) {
+      ret = AVERROR(ENOMEM);
+      goto end;
+    }
+
+    if ((ret = av_hwframe_transfer_data(sw, in, 0)) < 0 ||
+        (ret = av_hwframe_transfer_data(out, sw, 0)) < 0) {
+      av_log(ctx, AV_LOG_ERROR, "error copying a shared hardware frame\n");
+      goto end;
+    }
+  }
+
+  if ((ret = av_frame_copy_props(out, in)) < 0) {
+    goto end;
+  }
+
+  av_frame_free(frame);
+  *frame = out;
+  out = NULL;
+
+end:
+  av_frame_free(&sw);
+  av_frame_free(&out);
+  return ret;
+}
+
+static int filter_frame_hw(AVFilterContext* ctx, AVFrame* in, double time_ms) {
+  ProxyContext* pc = ctx->priv;
+  AVFrame* mapped = NULL;
+
+  int64_t start = av_gettime_relative();
+  int ret = make_hw_writable(ctx, &in);
+  add_timing(pc->timings, STAGE_WRITABLE, start);
+  if (ret < 0) {
+    av_frame_free(&in);
+    return ret;
+  }
+
+  AVHWFramesContext* frames = (AVHWFramesContext*)in->hw_frames_ctx->data;
+
+  ProxyHwFrame hw = {
+      .hw_format = av_get_pix_fmt_name(in->format),
+      .sw_format = av_get_pix_fmt_name(frames->sw_format),
+      .width = in->width,
+      .height = in->height,
+      .hwctx = frames->device_ctx->hwctx,
+      .fd = {-1, -1, -1, -1},
+  };
+
+  const AVDRMFrameDescriptor* drm = NULL;
+  if (in->format == AV_PIX_FMT_DRM_PRIME) {
+    drm = (const AVDRMFrameDescriptor*)in->data[0];
+  } else if (in->format == AV_PIX_FMT_VAAPI) {
+    hw.surface = in->data[3];
+    mapped = av_frame_alloc();
+    if (!mapped) {
+      ret = AVERROR(ENOMEM);
+      goto fail;
+    }
+
+    mapped->format = AV_PIX_FMT_DRM_PRIME;
+    ret = av_hwframe_map(mapped, in,
+                         AV_HWFRAME_MAP_READ | AV_HWFRAME_MAP_WRITE);
+    if (ret < 0) {
+      av_log(ctx, AV_LOG_ERROR, "error mapping frame to DRM\n");
+      goto fail;
+    }
+    drm = (const AVDRMFrameDescriptor*)mapped->data[0];
+  } else {
+    hw.nb_planes = av_pix_fmt_count_planes(frames->sw_format);
+    for (int i = 0; i < hw.nb_planes && i < 4; i++) {
+      hw.data[i] = in->data[i];
+      hw.line_size[i] = in->linesize[i];
+    }
+  }
+
+  if (drm) {
+    hw.drm_format = drm->layers[0].format;
+    hw.modifier = drm->objects[0].format_modifier;
+    for (int i = 0; i < drm->nb_layers; i++) {
+      const AVDRMLayerDescriptor* layer = &drm->layers[i];
+      for (int j = 0; j < layer->nb_planes && hw.nb_planes < 4; j++) {
+        const AVDRMPlaneDescriptor* plane = &layer->planes[j];
+        hw.fd[hw.nb_planes] = drm->objects[plane->object_index].fd;
+        hw.offset[hw.nb_planes] = plane->offset;
+        hw.line_size[hw.nb_planes] = plane->pitch;
+        hw.nb_planes++;
+      }
+    }
+  }
+
+  start = av_gettime_relative();
+  int rc = pc->filter_frame_hw(&hw, time_ms, pc->user_data);
+  add_timing(pc->timings, STAGE_RENDER, start);
+  if (rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "filter_frame_hw returned: %d\n", rc);
+    ret = AVERROR_UNKNOWN;
+  }
+
+fail:
+  av_frame_free(&mapped);
+  if (ret < 0) {
+    av_frame_free(&in);
+    return ret;
+  }
+
+  return send_frame(ctx, in, pc->timings);
+}
+
+static void owned_buffer_free(void* opaque, uint8_t* data) {
+  OwnedBuffer* owned = opaque;
+
+  owned->release(owned->opaque, data);
+  if (owned->handle) {
+    dlclose(owned->handle);
+  }
+  av_free(owned);
+}
+
+static int filter_frame_owned(AVFilterContext* ctx,
+                              AVFrame* in,
+                              double time_ms) {
+  ProxyContext* pc = ctx->priv;
+  unsigned char* data = NULL;
+  int line_size = 0;
+  void (*release)(void*, unsigned char*) = NULL;
+  void* opaque = NULL;
+  int ret;
+
+  int64_t start = av_gettime_relative();
+  int rc = pc->filter_get_frame(in->width, in->height, time_ms, &data,
+                                &line_size, &release, &opaque, pc->user_data);
+  add_timing(pc->timings, STAGE_RENDER, start);
+
+  if (rc == FRAME_UNCHANGED) {
+    ret = push_unchanged(ctx, in, pc->timings);
+    av_frame_free(&in);
+    return ret;
+  }
+
+  if (rc != 0 || !data || !release || line_size < in->width * 4) {
+    av_log(ctx, AV_LOG_ERROR, "filter_get_frame returned: %d\n", rc);
+    if (data && release) {
+      release(opaque, data);
+    }
+    av_frame_free(&in);
+    return AVERROR_UNKNOWN;
+  }
+
+  // The buffer may outlive the filter, so it holds its own reference to the
+  // library that has to release it.
+  OwnedBuffer* owned = av_mallocz(sizeof(*owned));
+  AVFrame* out = av_frame_alloc();
+  if (!owned || !out) {
+    ret = AVERROR(ENOMEM);
+    goto fail;
+  }
+
+  owned->release = release;
+  owned->opaque = opaque;
+  owned->handle = dlopen(pc->filter_path, RTLD_LAZY | RTLD_NOLOAD);
+
+  out->buf[0] = av_buffer_create(data, (size_t)line_size * in->height,
+                                 owned_buffer_free, owned,
+                                 AV_BUFFER_FLAG_READONLY);
+  if (!out->buf[0]) {
+    if (owned->handle) {
+      dlclose(owned->handle);
+    }
+    ret = AVERROR(ENOMEM);
+    goto fail;
+  }
+  owned = NULL;
+  data = NULL;
+
+  out->data[0] = out->buf[0]->data;
+  out->linesize[0] = line_size;
+  out->format = in->format;
+  out->width = in->width;
+  out->height = in->height;
+
+  if ((ret = av_frame_copy_props(out, in)) < 0) {
+    goto fail;
+  }
+
+  av_frame_free(&in);
+  return push_frame(ctx, out, pc->timings);
+
+fail:
+  if (data) {
+    release(opaque, data);
+  }
+  av_free(owned);
+  av_frame_free(&out);
+  av_frame_free(&in);
+  return ret;
+}
+
+static AVFrame* alloc_pool_frame(ProxyContext* pc, int format, int w, int h) {
+  AVFrame* frame = av_frame_alloc();
+  if (!frame) {
+    return NULL;
+  }
+
+  frame->buf[0] = av_buffer_pool_get(pc->pool);
+  if (!frame->buf[0]) {
+    av_frame_free(&frame);
+    return NULL;
+  }
+
+  frame->data[0] = frame->buf[0]->data;
+  frame->linesize[0] = pc->pool_line_size;
+  frame->format = format;
+  frame->width = w;
+  frame->height = h;
+
+  return frame;
+}
+
+static int get_pool_frame(AVFilterContext* ctx, AVFrame** frame) {
+  ProxyContext* pc = ctx->priv;
+  AVFrame* in = *frame;
+
+  if (ctx->nb_inputs &&
+      (in->width != ctx->outputs[0]->w || in->height != ctx->outputs[0]->h)) {
+    return ff_inlink_make_frame_writable(ctx->inputs[0], frame);
+  }
+
+  AVFrame* out = alloc_pool_frame(pc, in->format, in->width, in->height);
+  if (!out) {
+    return AVERROR(ENOMEM);
+  }
+
+  int ret = av_frame_copy_props(out, in);
+  if (ret < 0) {
+    av_frame_free(&out);
+    return ret;
+  }
+
+  av_frame_free(frame);
+  *frame = out;
+
+  return 0;
+}
+
+static int64_t lookahead_pts(AVFilterContext* ctx, int64_t n) {
+  AVFilterLink* inlink = ctx->inputs[0];
+  ProxyContext* pc = ctx->priv;
+
+  return pc->la_base +
+         av_rescale_q(n, av_inv_q(inlink->frame_rate), inlink->time_base);
+}
+
+static void* lookahead_thread(void* arg) {
+  AVFilterContext* ctx = arg;
+  AVFilterLink* outlink = ctx->outputs[0];
+  ProxyContext* pc = ctx->priv;
+  unsigned int data_size =
+      av_image_get_buffer_size(outlink->format, outlink->w, outlink->h, 1);
+
+  host_enter(ctx, 0);
+  place_thread(ctx);
+  if (pc->trace) {
+    trace_buf = trace_new(pc, "proxy lookahead");
+  }
+
+  pthread_mutex_lock(&pc->lock);
+  for (;;) {
+    while (!pc->exiting && pc->nb_la >= pc->lookahead) {
+      pthread_cond_wait(&pc->job_cond, &pc->lock);
+    }
+
+    if (pc->exiting) {
+      break;
+    }
+
+    LookaheadFrame* la = &pc->la[(pc->la_head + pc->nb_la) % MAX_DEPTH];
+    frame_index = pc->la_base_index + pc->la_count;
+    la->pts = lookahead_pts(ctx, pc->la_count++);
+    pc->nb_la++;
+    pc->la_busy = 1;
+    frame_pts = la->pts;
+    pthread_mutex_unlock(&pc->lock);
+
+    int64_t timings[NB_STAGES];
+    for (int i = 0; i < NB_STAGES; i++) {
+      timings[i] = -1;
+    }
+
+    int rc = 0;
+    AVFrame* frame =
+        alloc_pool_frame(pc, outlink->format, outlink->w, outlink->h);
+    if (frame) {
+      int64_t start = av_gettime_relative();
+      clear_image(pc, frame, 0, frame->height);
+      add_timing(timings, STAGE_CLEAR, start);
+
+      start = av_gettime_relative();
+      rc = call_filter_frame(pc, frame, data_size,
+                             la->pts * av_q2d(outlink->time_base) * 1000,
+                             PROXY_FRAME_PREDICTED, pc->user_data);
+      add_timing(timings, STAGE_RENDER, start);
+    }
+
+    pthread_mutex_lock(&pc->lock);
+    la->frame = frame;
+    la->rc = rc;
+    memcpy(la->timings, timings, sizeof(timings));
+    la->done = 1;
+    pc->la_busy = 0;
+    pthread_cond_broadcast(&pc->done_cond);
+  }
+  pthread_mutex_unlock(&pc->lock);
+
+  return NULL;
+}
+
+static void lookahead_pop(ProxyContext* pc) {
+  memset(&pc->la[pc->la_head], 0, sizeof(pc->la[pc->la_head]));
+  pc->la_head = (pc->la_head + 1) % MAX_DEPTH;
+  pc->nb_la--;
+}
+
+static int filter_frame_lookahead(AVFilterContext* ctx,
+                                  AVFrame* in,
+                                  unsigned int data_size,
+                                  double time_ms) {
+  AVFilterLink* outlink = ctx->outputs[0];
+  ProxyContext* pc = ctx->priv;
+  AVFrame* out = NULL;
+  int ret = 0;
+  int rc = 0;
+
+  pthread_mutex_lock(&pc->lock);
+
+  // Predictions for frames that never arrived are dropped, a prediction for
+  // this frame is waited for, anything else is a miss.
+  LookaheadFrame* head = NULL;
+  while (pc->nb_la > 0) {
+    head = &pc->la[pc->la_head];
+    while (!head->done && head->pts <= in->pts) {
+      pthread_cond_wait(&pc->done_cond, &pc->lock);
+    }
+
+    if (head->pts >= in->pts) {
+      break;
+    }
+
+    av_frame_free(&head->frame);
+    lookahead_pop(pc);
+    head = NULL;
+  }
+
+  if (head && head->pts == in->pts) {
+    out = head->frame;
+    rc = head->rc;
+    for (int i = STAGE_CLEAR; i <= STAGE_RENDER; i++) {
+      pc->timings[i] = head->timings[i];
+    }
+    lookahead_pop(pc);
+    pc->la_hits++;
+  } else {
+    while (pc->la_busy) {
+      pthread_cond_wait(&pc->done_cond, &pc->lock);
+    }
+
+    while (pc->nb_la > 0) {
+      av_frame_free(&pc->la[pc->la_head].frame);
+      lookahead_pop(pc);
+    }
+
+    if (pc->la_running) {
+      pc->la_misses++;
+    }
+    pc->la_base = in->pts;
+    pc->la_base_index = frame_index;
+    pc->la_count = 1;
+
+    out = alloc_pool_frame(pc, outlink->format, outlink->w, outlink->h);
+    if (out) {
+      rc = render_frame(ctx, out, data_size, time_ms, 1);
+    }
+
+    if (!pc->la_running) {
+      ret = AVERROR(pthread_create(&pc->la_thread, NULL, lookahead_thread,
+                                   ctx));
+      pc->la_running = !ret;
+    }
+  }
+
+  pthread_cond_signal(&pc->job_cond);
+  pthread_mutex_unlock(&pc->lock);
+
+  if (ret < 0 || !out) {
+    if (ret < 0) {
+      av_log(ctx, AV_LOG_ERROR, "error creating lookahead thread\n");
+    }
+    av_frame_free(&out);
+    av_frame_free(&in);
+    return ret < 0 ? ret : AVERROR(ENOMEM);
+  }
+
+  if (rc == FRAME_UNCHANGED) {
+    ret = push_unchanged(ctx, in, pc->timings);
+    av_frame_free(&out);
+    av_frame_free(&in);
+    return ret;
+  }
+
+  if (rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "filter_frame returned: %d\n", rc);
+    av_frame_free(&out);
+    av_frame_free(&in);
+    return AVERROR_UNKNOWN;
+  }
+
+  ret = av_frame_copy_props(out, in);
+  av_frame_free(&in);
+  if (ret < 0) {
+    av_frame_free(&out);
+    return ret;
+  }
+
+  return push_frame(ctx, out, pc->timings);
+}
+
+static int filter_frame_deadline(AVFilterContext* ctx,
+                                 AVFrame* in,
+                                 unsigned int data_size,
+                                 double time_ms) {
+  AVFilterLink* outlink = ctx->outputs[0];
+  ProxyContext* pc = ctx->priv;
+  AVFrame* out = NULL;
+  AVFrame* late;
+  int late_rc = 0;
+  int rc = DEADLINE_MISSED;
+  int ret;
+
+  // A late render replaces the last frame, so that it's what is passed on
+  // for misses and unchanged frames from here on.
+  int idle = deadline_idle(pc, &late, &late_rc);
+  if (late && late_rc == 0) {
+    av_frame_free(&pc->last_out);
+    pc->last_out = late;
+    if (pc->alpha_bbox) {
+      scan_alpha(pc, late);
+    }
+    for (int i = 0; i < pc->nb_scaled; i++) {
+      av_frame_free(&pc->scaled[i].last);
+    }
+  } else if (late) {
+    av_frame_free(&late);
+    if (late_rc != FRAME_UNCHANGED) {
+      av_log(ctx, AV_LOG_ERROR, "filter_frame returned: %d\n", late_rc);
+      av_frame_free(&in);
+      return AVERROR_UNKNOWN;
+    }
+  }
+
+  if (idle) {
+    out = alloc_pool_frame(pc, outlink->format, outlink->w, outlink->h);
+    if (!out) {
+      av_frame_free(&in);
+      return AVERROR(ENOMEM);
+    }
+
+    rc = deadline_render(ctx, out, data_size, time_ms);
+    if (rc == DEADLINE_MISSED) {
+      out = NULL;
+    }
+  }
+
+  if (rc == DEADLINE_MISSED) {
+    av_dict_set(&in->metadata, "lavfi.proxy.deadline_missed", "1", 0);
+    rc = FRAME_UNCHANGED;
+
+    // Nothing has been rendered yet, so a cleared frame is passed on.
+    if (!pc->last_out) {
+      out = alloc_pool_frame(pc, outlink->format, outlink->w, outlink->h);
+      if (!out) {
+        av_frame_free(&in);
+        return AVERROR(ENOMEM);
+      }
+
+      int64_t start = av_gettime_relative();
+      clear_image(pc, out, 0, out->height);
+      add_timing(pc->timings, STAGE_CLEAR, start);
+      rc = 0;
+    }
+  }
+
+  if (rc == FRAME_UNCHANGED) {
+    ret = push_unchanged(ctx, in, pc->timings);
+    av_frame_free(&out);
+    av_frame_free(&in);
+    return ret;
+  }
+
+  if (rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "filter_frame returned: %d\n", rc);
+    av_frame_free(&out);
+    av_frame_free(&in);
+    return AVERROR_UNKNOWN;
+  }
+
+  ret = av_frame_copy_props(out, in);
+  av_frame_free(&in);
+  if (ret < 0) {
+    av_frame_free(&out);
+    return ret;
+  }
+
+  return push_frame(ctx, out, pc->timings);
+}
+
+static int reconfigure(AVFilterContext* ctx, const char* config) {
+  ProxyContext* pc = ctx->priv;
+
+  if (!pc->filter_reconfigure) {
+    av_log(ctx, AV_LOG_ERROR, "filter_reconfigure isn't provided\n");
+    return AVERROR(ENOSYS);
+  }
+
+  // Renders in progress are finished first, and no new ones are started,
+  // while every instance is reconfigured.
+  if (pc->locks_init) {
+    pthread_mutex_lock(&pc->lock);
+    for (int i = 0; i < pc->nb_pending; i++) {
+      PendingFrame* p = &pc->pending[(pc->pending_head + i) % MAX_DEPTH];
+      while (p->started && !p->done) {
+        pthread_cond_wait(&pc->done_cond, &pc->lock);
+      }
+    }
+
+    while (pc->la_busy || pc->dl_state == DEADLINE_PENDING) {
+      pthread_cond_wait(&pc->done_cond, &pc->lock);
+    }
+  }
+
+  // Commands queued with a time are run by activate, which already holds the
+  // lock of a shared filter. A thread safe one is only locked for reading then,
+  // and the other proxies using it are waited for.
+  int relock = pc->shared && (!pc->shared_locked || pc->shared->thread_safe);
+  if (relock) {
+    if (pc->shared_locked) {
+      unlock_shared(pc);
+    }
+    pthread_rwlock_wrlock(&pc->shared->lock);
+  }
+
+  int rc = pc->filter_reconfigure(config, pc->user_data);
+  for (int i = 1; i < pc->nb_workers_init && rc == 0; i++) {
+    rc = pc->filter_reconfigure(config, pc->workers[i].user_data);
+  }
+
+  if (relock) {
+    unlock_shared(pc);
+    if (pc->shared_locked) {
+      lock_shared(pc);
+    }
+  }
+
+  if (pc->locks_init) {
+    // Frames rendered ahead with the previous config are rendered again.
+    pc->la_count -= pc->nb_la;
+    while (pc->nb_la > 0) {
+      av_frame_free(&pc->la[pc->la_head].frame);
+      lookahead_pop(pc);
+    }
+    pthread_cond_signal(&pc->job_cond);
+    pthread_mutex_unlock(&pc->lock);
+  }
+
+  if (rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "filter_reconfigure returned: %d\n", rc);
+    return AVERROR(EINVAL);
+  }
+
+  return 0;
+}
+
+static int process_command(AVFilterContext* ctx,
+                           const char* cmd,
+                           const char* args,
+                           char* res,
+                           int res_len,
+                           int flags) {
+  ProxyContext* pc = ctx->priv;
+  int ret;
+
+  host_enter(ctx, 1);
+
+  if (strcmp(cmd, "config")) {
+    return AVERROR(ENOSYS);
+  }
+
+  if (pc->transport == TRANSPORT_SHM) {
+    ShmMessage msg = {.type = SHM_MSG_CONFIG};
+    if (pc->ring &&
+        (send(pc->sock, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg) ||
+         send(pc->sock, args, strlen(args) + 1, MSG_NOSIGNAL) < 0)) {
+      av_log(ctx, AV_LOG_ERROR, "error sending config: %s\n",
+             strerror(errno));
+      return AVERROR(EIO);
+    }
+  } else if ((ret = reconfigure(ctx, args)) < 0) {
+    return ret;
+  }
+
+  char* config = av_strdup(args);
+  if (!config) {
+    return AVERROR(ENOMEM);
+  }
+  av_free(pc->config);
+  pc->config = config;
+
+  return 0;
+}
+
+static int process_frame(AVFilterContext* ctx, AVFrame* in, double time_ms) {
+  ProxyContext* pc = ctx->priv;
+  int64_t start;
+  int ret = 0;
+
+  // A frame of another size than the link, which get_pool_frame passes on in
+  // its own buffer, gets a descriptor of its own.
+  if (in->width != pc->desc.width || in->height != pc->desc.height) {
+    ret = fill_desc(pc, in->format, in->width, in->height,
+                    (AVRational){pc->desc.time_base_num,
+                                 pc->desc.time_base_den});
+    if (ret < 0) {
+      av_frame_free(&in);
+      return ret;
+    }
+  }
+
+  unsigned int data_size = pc->desc.data_size;
+
+  if (same_tick(ctx, in, &time_ms) && pc->last_out) {
+    ret = push_unchanged(ctx, in, pc->timings);
+    av_frame_free(&in);
+    return ret;
+  }
+
+  if (pc->lookahead) {
+    return filter_frame_lookahead(ctx, in, data_size, time_ms);
+  }
+
+  if (pc->deadline_ms) {
+    return filter_frame_deadline(ctx, in, data_size, time_ms);
+  }
+
+  if (pc->filter_get_frame && pc->discard_input && !pc->threaded &&
+      !pc->filter_send_frame && pc->batch <= 1) {
+    return filter_frame_owned(ctx, in, time_ms);
+  }
+
+  // Canvas frames are kept as the last output too, so render_rate passes them
+  // on again like any other.
+  if (pc->discard_input && pc->filter_damage && !pc->threaded &&
+      !pc->filter_send_frame && pc->batch <= 1) {
+    return filter_frame_canvas(ctx, in, data_size, time_ms);
+  }
+
+  if (pc->ring) {
+    // The oldest frame in flight is waited for when the ring is full, and
+    // frames are copied out of it as they are passed on. An input already in
+    // the ring is rendered on in place and needs no slot of its own.
+    if (!shm_nb_free(pc->ring) && pc->nb_pending > 0 &&
+        (pc->discard_input || !shm_owns(pc->ring, in))) {
+      ret = receive_frames(ctx, 1);
+    }
+    if (ret >= 0) {
+      ret = shm_prepare_frame(ctx, &in);
+    }
+  } else if (pc->discard_input && !pc->spare) {
+    start = av_gettime_relative();
+    ret = get_pool_frame(ctx, &in);
+    add_timing(pc->timings, STAGE_WRITABLE, start);
+  }
+
+  if (ret < 0) {
+    av_frame_free(&in);
+    return ret;
+  }
+
+  if (pc->clear && (pc->threaded || pc->filter_send_frame || pc->batch > 1)) {
+    start = av_gettime_relative();
+    clear_image(pc, in, 0, in->height);
+    add_timing(pc->timings, STAGE_CLEAR, start);
+  }
+
+  if (pc->threaded) {
+    pthread_mutex_lock(&pc->lock);
+    PendingFrame* p =
+        &pc->pending[(pc->pending_head + pc->nb_pending) % MAX_DEPTH];
+    p->frame = in;
+    p->data_size = data_size;
+    p->ts_millis = time_ms;
+    p->queued = av_gettime_relative();
+    p->index = frame_index;
+    memcpy(p->timings, pc->timings, sizeof(p->timings));
+    pc->nb_pending++;
+    pthread_cond_signal(&pc->job_cond);
+    pthread_mutex_unlock(&pc->lock);
+
+    return receive_frames(ctx, 0);
+  }
+
+  if (pc->filter_send_frame) {
+    start = av_gettime_relative();
+    int rc = pc->filter_send_frame(in->data[0], data_size, in->width,
+                                   in->height, in->linesize[0], time_ms,
+                                   pc->user_data);
+    if (rc != 0) {
+      av_log(ctx, AV_LOG_ERROR, "filter_send_frame returned: %d\n", rc);
+      av_frame_free(&in);
+      return AVERROR_UNKNOWN;
+    }
+
+    PendingFrame* p =
+        &pc->pending[(pc->pending_head + pc->nb_pending) % MAX_DEPTH];
+    p->frame = in;
+    p->sent = start;
+    memcpy(p->timings, pc->timings, sizeof(p->timings));
+    pc->nb_pending++;
+
+    return receive_frames(ctx, 0);
+  }
+
+  if (pc->batch > 1) {
+    PendingFrame* p =
+        &pc->pending[(pc->pending_head + pc->nb_pending) % MAX_DEPTH];
+    p->frame = in;
+    p->data_size = data_size;
+    p->ts_millis = time_ms;
+    p->queued = av_gettime_relative();
+    memcpy(p->timings, pc->timings, sizeof(p->timings));
+    pc->nb_pending++;
+
+    return pc->nb_pending < pc->batch ? 0 : flush_batch(ctx);
+  }
+
+  AVFrame* out = in;
+  int clear = pc->clear;
+  if (pc->spare) {
+    out = pc->spare;
+    pc->spare = NULL;
+    clear = 0;
+
+    ret = av_frame_copy_props(out, in);
+    av_frame_free(&in);
+    if (ret < 0) {
+      av_frame_free(&out);
+      return ret;
+    }
+  }
+
+  int rc = render_frame(ctx, out, data_size, time_ms, clear);
+  if (rc == FRAME_UNCHANGED) {
+    ret = push_unchanged(ctx, out, pc->timings);
+    if (pc->discard_input) {
+      pc->spare = out;
+    } else {
+      av_frame_free(&out);
+    }
+    return ret;
+  }
+
+  if (rc != 0) {
+    av_log(ctx, AV_LOG_ERROR, "filter_frame returned: %d\n", rc);
+    av_frame_free(&out);
+    return AVERROR_UNKNOWN;
+  }
+
+  return push_frame(ctx, out, pc->timings);
+}
+
+static void reset_timings(ProxyContext* pc) {
+  for (int i = 0; i < NB_STAGES; i++) {
+    pc->timings[i] = -1;
+  }
+}
+
+static int filter_frame(AVFilterLink* inlink, AVFrame* in) {
+  AVFilterContext* ctx = inlink->dst;
+  ProxyContext* pc = ctx->priv;
+
+  reset_timings(pc);
+  frame_pts = in->pts;
+  frame_index = pc->nb_frames++;
+
+  if (in->hw_frames_ctx) {
+    return filter_frame_hw(ctx, in,
+                           in->pts * av_q2d(inlink->time_base) * 1000);
+  }
+
+  int ret;
+  int64_t start = av_gettime_relative();
+  if (!pc->discard_input &&
+      (ret = ff_inlink_make_frame_writable(inlink, &in)) < 0) {
+    av_frame_free(&in);
+    return ret;
+  }
+  add_timing(pc->timings, STAGE_WRITABLE, start);
+
+  av_assert0(in->format != -1);
+
+  if (pc->region && !pc->blend) {
+    in->crop_left = pc->render_x;
+    in->crop_top = pc->render_y;
+    in->crop_right = in->width - pc->render_x - pc->region_w;
+    in->crop_bottom = in->height - pc->render_y - pc->region_h;
+    if ((ret = av_frame_apply_cropping(in, AV_FRAME_CROP_UNALIGNED)) < 0) {
+      av_log(ctx, AV_LOG_ERROR, "error cropping the render region\n");
+      av_frame_free(&in);
+      return ret;
+    }
+  }
+
+  double time_ms = in->pts * av_q2d(inlink->time_base) * 1000;
+
+  if (pc->blend) {
+    return filter_frame_blend(ctx, in, time_ms);
+  }
+
+  return process_frame(ctx, in, time_ms);
+}
+
+// With outputs the proxy keeps going until all of its outputs are closed, and
+// renders whenever any of them wants a frame.
+static int outputs_status(AVFilterContext* ctx) {
+  int status = 0;
+
+  for (unsigned i = 0; i < ctx->nb_outputs; i++) {
+    if (!(status = ff_outlink_get_status(ctx->outputs[i]))) {
+      return 0;
+    }
+  }
+
+  return status;
+}
+
+static int outputs_wanted(AVFilterContext* ctx) {
+  for (unsigned i = 0; i < ctx->nb_outputs; i++) {
+    if (ff_outlink_frame_wanted(ctx->outputs[i])) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void set_outputs_status(AVFilterContext* ctx, int status, int64_t pts) {
+  for (unsigned i = 0; i < ctx->nb_outputs; i++) {
+    if (!ff_outlink_get_status(ctx->outputs[i])) {
+      ff_outlink_set_status(ctx->outputs[i], status, pts);
+    }
+  }
+}
+
+static int activate_filter(AVFilterContext* ctx) {
+  AVFilterLink* inlink = ctx->inputs[0];
+  ProxyContext* pc = ctx->priv;
+  AVFrame* in;
+  int64_t pts;
+  int ret, status;
+
+  if ((status = outputs_status(ctx))) {
+    ff_inlink_set_status(inlink, status);
+    return 0;
+  }
+
+  if (pc->nb_pending > 0 && (ret = receive_frames(ctx, 0)) < 0) {
+    return ret;
+  }
+
+  ret = ff_inlink_consume_frame(inlink, &in);
+  if (ret < 0) {
+    return ret;
+  }
+
+  if (ret > 0) {
+    ret = filter_frame(inlink, in);
+    if (ret >= 0) {
+      ff_filter_set_ready(ctx, 100);
+    }
+    return ret;
+  }
+
+  if (ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+    if ((ret = receive_frames(ctx, MAX_DEPTH)) < 0) {
+      return ret;
+    }
+    set_outputs_status(ctx, status, pts);
+    return 0;
+  }
+
+  if (outputs_wanted(ctx)) {
+    ff_inlink_request_frame(inlink);
+    return 0;
+  }
+
+  return FFERROR_NOT_READY;
+}
+
+// A filter instance shared with other proxies is only used by one of them at
+// a time, unless it declares PROXY_CAP_THREAD_SAFE.
+static int activate_shared(AVFilterContext* ctx,
+                           int (*activate_fn)(AVFilterContext*)) {
+  ProxyContext* pc = ctx->priv;
+
+  host_enter(ctx, 1);
+
+  if (!pc->shared) {
+    return activate_fn(ctx);
+  }
+
+  lock_shared(pc);
+  pc->shared_locked = 1;
+  int ret = activate_fn(ctx);
+  pc->shared_locked = 0;
+  unlock_shared(pc);
+
+  return ret;
+}
+
+static int activate(AVFilterContext* ctx) {
+  return activate_shared(ctx, activate_filter);
+}
+
+static int query_formats(AVFilterContext* ctx) {
+  static const enum AVPixelFormat pix_fmts[] = {AV_PIX_FMT_BGRA,
+                                                AV_PIX_FMT_NONE};
+  static const enum AVPixelFormat blend_pix_fmts[] = {
+      AV_PIX_FMT_YUV420P,   AV_PIX_FMT_YUV422P,   AV_PIX_FMT_YUV444P,
+      AV_PIX_FMT_YUVJ420P,  AV_PIX_FMT_YUVJ422P,  AV_PIX_FMT_YUVJ444P,
+      AV_PIX_FMT_YUV420P10, AV_PIX_FMT_YUV422P10, AV_PIX_FMT_YUV444P10,
+      AV_PIX_FMT_NONE};
+  ProxyContext* pc = ctx->priv;
+
+  host_enter(ctx, 1);
+
+  if (pc->blend) {
+    return ff_set_common_formats_from_list(ctx, blend_pix_fmts);
+  }
+
+  const char* names = NULL;
+  if (!pc->clear && pc->batch <= 1 && pc->filter_query_formats) {
+    if (pc->shared) {
+      lock_shared(pc);
+    }
+    names = pc->filter_query_formats(pc->user_data);
+    if (pc->shared) {
+      unlock_shared(pc);
+    }
+  }
+
+  if (!names || !*names) {
+    return ff_set_common_formats_from_list(ctx, pix_fmts);
+  }
+
+  char* list = av_strdup(names);
+  if (!list) {
+    return AVERROR(ENOMEM);
+  }
+
+  AVFilterFormats* formats = NULL;
+  char* saveptr = NULL;
+  int ret = 0;
+  for (char* name = av_strtok(list, "|", &saveptr); name;
+       name = av_strtok(NULL, "|", &saveptr)) {
+    enum AVPixelFormat pix_fmt = av_get_pix_fmt(name);
+    if (pix_fmt == AV_PIX_FMT_NONE) {
+      av_log(ctx, AV_LOG_ERROR, "unknown pixel format: %s\n", name);
+      ret = AVERROR(EINVAL);
+      break;
+    }
+
+    if ((ret = ff_add_format(&formats, pix_fmt)) < 0) {
+      break;
+    }
+  }
+  av_free(list);
+
+  if (ret < 0) {
+    ff_formats_unref(&formats);
+    return ret;
+  }
+
+  return ff_set_common_formats(ctx, formats);
+}
+
+static AVFrame* get_video_buffer(AVFilterLink* inlink, int w, int h) {
+  ProxyContext* pc = inlink->dst->priv;
+
+  // A discarded input is never rendered on, so it's left out of the ring.
+  if (pc->ring && !pc->discard_input && w == inlink->w && h == inlink->h) {
+    AVFrame* frame = shm_get_frame(pc, w, h);
+    if (frame) {
+      frame->sample_aspect_ratio = inlink->sample_aspect_ratio;
+      return frame;
+    }
+  }
+
+  return ff_default_get_video_buffer(inlink, w, h);
+}
+
+static void node_buffer_free(void* opaque, uint8_t* data) {
+  munmap(data, (size_t)(uintptr_t)opaque);
+}
+
+// With numa_node the pool buffers are mapped fresh and bound to the node
+// before they are first touched.
+static AVBufferRef* node_buffer_alloc(void* opaque, size_t size) {
+  unsigned long mask = 1UL << (intptr_t)opaque;
+
+  uint8_t* data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  // Binding is best effort, the memory is still usable on any node.
+  // The kernel reads one bit less of the mask than maxnode.
+  syscall(SYS_mbind, data, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1,
+          0);
+
+  AVBufferRef* buf =
+      av_buffer_create(data, size, node_buffer_free, (void*)(uintptr_t)size, 0);
+  if (!buf) {
+    munmap(data, size);
+  }
+
+  return buf;
+}
+
+static int config_buffers(AVFilterContext* ctx, int w, int h) {
+  ProxyContext* pc = ctx->priv;
+
+  if (pc->discard_input && !pc->ring) {
+    pc->pool_line_size = FFALIGN(w * 4, 64);
+    av_buffer_pool_uninit(&pc->pool);
+    if (pc->numa_node >= 0) {
+      pc->pool = av_buffer_pool_init2(pc->pool_line_size * h,
+                                      (void*)(intptr_t)pc->numa_node,
+                                      node_buffer_alloc, NULL);
+    } else {
+      pc->pool = av_buffer_pool_init(pc->pool_line_size * h, NULL);
+    }
+    if (!pc->pool) {
+      return AVERROR(ENOMEM);
+    }
+  }
+
+  if (pc->deadline_ms && !pc->dl_running) {
+    int ret =
+        AVERROR(pthread_create(&pc->dl_thread, NULL, deadline_thread, ctx));
+    if (ret < 0) {
+      av_log(ctx, AV_LOG_ERROR, "error creating deadline thread\n");
+      return ret;
+    }
+    pc->dl_running = 1;
+  }
+
+  if (pc->filter_slice) {
+    pc->nb_slices = ff_filter_get_nb_threads(ctx);
+    av_freep(&pc->slice_rc);
+    pc->slice_rc = av_calloc(pc->nb_slices, sizeof(*pc->slice_rc));
+    if (!pc->slice_rc) {
+      return AVERROR(ENOMEM);
+    }
+  }
+
+  return 0;
+}
+
+static int config_input(AVFilterLink* inlink) {
+  AVFilterContext* ctx = inlink->dst;
+  ProxyContext* pc = ctx->priv;
+
+  host_enter(ctx, 1);
+
+  if (pc->transport == TRANSPORT_SHM) {
+    int ret = config_shm(ctx, inlink);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(inlink->format);
+  pc->region = pc->render_x || pc->render_y || pc->render_w || pc->render_h;
+  pc->region_w = pc->render_w ? pc->render_w : inlink->w - pc->render_x;
+  pc->region_h = pc->render_h ? pc->render_h : inlink->h - pc->render_y;
+  if (pc->region) {
+    int x_align = (1 << desc->log2_chroma_w) - 1;
+    int y_align = (1 << desc->log2_chroma_h) - 1;
+    if (pc->region_w <= 0 || pc->region_h <= 0 ||
+        pc->render_x + pc->region_w > inlink->w ||
+        pc->render_y + pc->region_h > inlink->h ||
+        (pc->render_x & x_align) || (pc->render_y & y_align)) {
+      av_log(ctx, AV_LOG_ERROR, "invalid render region %dx%d+%d+%d\n",
+             pc->region_w, pc->region_h, pc->render_x, pc->render_y);
+      return AVERROR(EINVAL);
+    }
+
+    if ((desc->flags & AV_PIX_FMT_FLAG_HWACCEL) ||
+        (pc->ring && !pc->discard_input)) {
+      av_log(ctx, AV_LOG_ERROR,
+             "a render region needs system memory frames and clear with "
+             "the shm transport\n");
+      return AVERROR(EINVAL);
+    }
+  }
+
+  if (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) {
+    if (!pc->filter_frame_hw || pc->filter_send_frame || pc->threaded) {
+      av_log(ctx, AV_LOG_ERROR, "%s needs a synchronous filter_frame_hw\n",
+             desc->name);
+      return AVERROR(EINVAL);
+    }
+    return 0;
+  }
+
+  if (av_pix_fmt_count_planes(inlink->format) > 1 && !pc->blend &&
+      (!(pc->filter_frame_planes || pc->filter_frame2) ||
+       pc->filter_send_frame)) {
+    av_log(ctx, AV_LOG_ERROR, "%s needs filter_frame_planes or filter_frame2\n",
+           av_get_pix_fmt_name(inlink->format));
+    return AVERROR(EINVAL);
+  }
+
+  if (pc->blend) {
+    pc->hsub = desc->log2_chroma_w;
+    pc->vsub = desc->log2_chroma_h;
+    pc->blend_depth = desc->comp[0].depth;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(pc->scratch); i++) {
+      av_frame_free(&pc->scratch[i]);
+      pc->scratch[i] = av_frame_alloc();
+      if (!pc->scratch[i]) {
+        return AVERROR(ENOMEM);
+      }
+
+      pc->scratch[i]->format = AV_PIX_FMT_BGRA;
+      pc->scratch[i]->width = pc->region_w;
+      pc->scratch[i]->height = pc->region_h;
+      int ret = av_frame_get_buffer(pc->scratch[i], 0);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+
+    pc->scratch_size = av_image_get_buffer_size(AV_PIX_FMT_BGRA, pc->region_w,
+                                                pc->region_h, 1);
+    pc->scratch_rendered = 0;
+    pc->back_clean = 0;
+  }
+
+  if (pc->lookahead &&
+      (inlink->frame_rate.num <= 0 || inlink->frame_rate.den <= 0)) {
+    av_log(ctx, AV_LOG_ERROR, "lookahead needs a constant frame rate\n");
+    return AVERROR(EINVAL);
+  }
+
+  int format = pc->blend ? AV_PIX_FMT_BGRA : inlink->format;
+  int ret = warmup(ctx, format, pc->region_w, pc->region_h);
+  if (ret < 0) {
+    return ret;
+  }
+
+  ret = fill_desc(pc, format, pc->region_w, pc->region_h, inlink->time_base);
+  if (ret < 0) {
+    return ret;
+  }
+
+  return config_buffers(ctx, pc->region_w, pc->region_h);
+}
+
+static const AVFilterPad inputs[] = {{
+    .name = "default",
+    .type = AVMEDIA_TYPE_VIDEO,
+    .get_buffer.video = get_video_buffer,
+    .config_props = config_input,
+}};
+
+static int config_output(AVFilterLink* outlink) {
+  AVFilterLink* inlink = outlink->src->inputs[0];
+  ProxyContext* pc = outlink->src->priv;
+
+  if (pc->region && !pc->blend) {
+    outlink->w = pc->region_w;
+    outlink->h = pc->region_h;
+  }
+
+  if (inlink->hw_frames_ctx) {
+    av_buffer_unref(&outlink->hw_frames_ctx);
+    outlink->hw_frames_ctx = av_buffer_ref(inlink->hw_frames_ctx);
+    if (!outlink->hw_frames_ctx) {
+      return AVERROR(ENOMEM);
+    }
+  }
+
+  return 0;
+}
+
+static const AVFilterPad outputs[] = {{
+    .name = "default",
+    .type = AVMEDIA_TYPE_VIDEO,
+    .config_props = config_output,
+}};
+
+static const AVOption proxy_options[] = {
+    {"filter_path",
+     "set the filter path",
+     OFFSET(filter_path),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"config",
+     "set the config",
+     OFFSET(config),
+     AV_OPT_TYPE_STRING,
+     {.str = ""},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"clear",
+     "clear frame before filtering",
+     OFFSET(clear),
+     AV_OPT_TYPE_BOOL,
+     {.i64 = 0},
+     0,
+     1,
+     FLAGS},
+    {"blend",
+     "blend the filtered frame onto the input frame",
+     OFFSET(blend),
+     AV_OPT_TYPE_BOOL,
+     {.i64 = 0},
+     0,
+     1,
+     FLAGS},
+    {"clear_rect",
+     "only clear the x|y|w|h rectangle of the frame",
+     OFFSET(clear_rect),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"render_x",
+     "set the left edge of the rendered region",
+     OFFSET(render_x),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     FLAGS},
+    {"render_y",
+     "set the top edge of the rendered region",
+     OFFSET(render_y),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     FLAGS},
+    {"render_w",
+     "set the width of the rendered region, or 0 for the rest of the frame",
+     OFFSET(render_w),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     FLAGS},
+    {"render_h",
+     "set the height of the rendered region, or 0 for the rest of the frame",
+     OFFSET(render_h),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     FLAGS},
+    {"depth",
+     "set the number of frames in flight for asynchronous filters",
+     OFFSET(depth),
+     AV_OPT_TYPE_INT,
+     {.i64 = 2},
+     1,
+     MAX_DEPTH,
+     FLAGS},
+    {"transport",
+     "set how the filter is run",
+     OFFSET(transport),
+     AV_OPT_TYPE_INT,
+     {.i64 = TRANSPORT_DLOPEN},
+     TRANSPORT_DLOPEN,
+     TRANSPORT_SHM,
+     FLAGS,
+     "transport"},
+    {"dlopen",
+     "load the filter into this process",
+     0,
+     AV_OPT_TYPE_CONST,
+     {.i64 = TRANSPORT_DLOPEN},
+     0,
+     0,
+     FLAGS,
+     "transport"},
+    {"shm",
+     "render in another process through shared memory",
+     0,
+     AV_OPT_TYPE_CONST,
+     {.i64 = TRANSPORT_SHM},
+     0,
+     0,
+     FLAGS,
+     "transport"},
+    {"socket",
+     "set the socket path of the renderer process",
+     OFFSET(socket_path),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"slots",
+     "set the number of frame slots in shared memory",
+     OFFSET(nb_slots),
+     AV_OPT_TYPE_INT,
+     {.i64 = 16},
+     2,
+     MAX_SLOTS,
+     FLAGS},
+    {"workers",
+     "set the number of filter instances rendering in parallel",
+     OFFSET(nb_workers),
+     AV_OPT_TYPE_INT,
+     {.i64 = 1},
+     1,
+     MAX_DEPTH,
+     FLAGS},
+    {"batch",
+     "set the number of frames passed to filter_frames at once",
+     OFFSET(batch),
+     AV_OPT_TYPE_INT,
+     {.i64 = 1},
+     1,
+     MAX_DEPTH,
+     FLAGS},
+    {"lookahead",
+     "set the number of frames rendered ahead from predicted timestamps",
+     OFFSET(lookahead),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     MAX_DEPTH,
+     FLAGS},
+    {"share",
+     "share one filter instance between proxies using the same key",
+     OFFSET(share),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"alpha_bbox",
+     "find the bounding box of the rendered pixels",
+     OFFSET(alpha_bbox),
+     AV_OPT_TYPE_BOOL,
+     {.i64 = 0},
+     0,
+     1,
+     FLAGS},
+    {"render_rate",
+     "set the rate to render at, or 0 to render every frame",
+     OFFSET(render_rate),
+     AV_OPT_TYPE_RATIONAL,
+     {.dbl = 0},
+     0,
+     INT_MAX,
+     FLAGS},
+    {"deadline_ms",
+     "set the time a render may take before the last frame is passed on",
+     OFFSET(deadline_ms),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     FLAGS},
+    {"bind_now",
+     "resolve all symbols of the filter when it's loaded",
+     OFFSET(bind_now),
+     AV_OPT_TYPE_BOOL,
+     {.i64 = 0},
+     0,
+     1,
+     FLAGS},
+    {"warmup",
+     "set the number of throwaway frames rendered before the first one",
+     OFFSET(warmup),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     FLAGS},
+    {"warmup_size",
+     "set the size of the throwaway frames to warm up in init",
+     OFFSET(warmup_w),
+     AV_OPT_TYPE_IMAGE_SIZE,
+     {.str = NULL},
+     0,
+     0,
+     FLAGS},
+    {"trace_file",
+     "write a trace of every frame's stages to this file",
+     OFFSET(trace_file),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"outputs",
+     "set the sizes of extra outputs scaled down from the render",
+     OFFSET(outputs),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"affinity",
+     "set the CPUs of the proxy's threads, e.g. 0-7|16-23",
+     OFFSET(affinity),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"numa_node",
+     "set the NUMA node of the proxy's threads and frame pool",
+     OFFSET(numa_node),
+     AV_OPT_TYPE_INT,
+     {.i64 = -1},
+     -1,
+     63,
+     FLAGS},
+    {"sched_priority",
+     "set the SCHED_FIFO priority of the proxy's threads",
+     OFFSET(sched_priority),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     99,
+     FLAGS},
+    {NULL},
+};
+
+AVFILTER_DEFINE_CLASS(proxy);
+
+const AVFilter ff_vf_proxy = {
+    .name = "proxy",
+    .description = NULL_IF_CONFIG_SMALL("Video filter proxy."),
+    .priv_size = sizeof(ProxyContext),
+    .flags = AVFILTER_FLAG_SLICE_THREADS | AVFILTER_FLAG_DYNAMIC_OUTPUTS,
+    .flags_internal = FF_FILTER_FLAG_HWFRAME_AWARE,
+    .preinit = preinit,
+    .init = init,
+    .uninit = uninit,
+    .activate = activate,
+    .process_command = process_command,
     FILTER_INPUTS(inputs),
     FILTER_OUTPUTS(outputs),
-    FILTER_SINGLE_PIXFMT(AV_PIX_FMT_BGRA),
+    FILTER_QUERY_FUNC(query_formats),
     .priv_class = &proxy_class,
 };
+
+static av_cold int init_src(AVFilterContext* ctx) {
+  ProxyContext* pc = ctx->priv;
+
+  pc->clear = 1;
+  pc->pts = 0;
+
+  return init(ctx);
+}
+
+static int activate_source(AVFilterContext* ctx) {
+  AVFilterLink* outlink = ctx->outputs[0];
+  ProxyContext* pc = ctx->priv;
+  int ret;
+
+  if (pc->nb_pending > 0 && (ret = receive_frames(ctx, 0)) < 0) {
+    return ret;
+  }
+
+  if (!outputs_wanted(ctx)) {
+    return FFERROR_NOT_READY;
+  }
+
+  // Asynchronous and threaded filters keep up to depth frames in flight, so
+  // the next frames are rendered before they are requested.
+  do {
+    if (pc->duration >= 0 &&
+        av_rescale_q(pc->pts, outlink->time_base, AV_TIME_BASE_Q) >=
+            pc->duration) {
+      if ((ret = receive_frames(ctx, MAX_DEPTH)) < 0) {
+        return ret;
+      }
+      set_outputs_status(ctx, AVERROR_EOF, pc->pts);
+      return 0;
+    }
+
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) {
+      return AVERROR(ENOMEM);
+    }
+
+    frame->format = outlink->format;
+    frame->width = outlink->w;
+    frame->height = outlink->h;
+    frame->sample_aspect_ratio = outlink->sample_aspect_ratio;
+    frame->pts = pc->pts++;
+
+    reset_timings(pc);
+    frame_pts = frame->pts;
+    frame_index = pc->nb_frames++;
+    ret = process_frame(ctx, frame,
+                        frame->pts * av_q2d(outlink->time_base) * 1000);
+    if (ret < 0) {
+      return ret;
+    }
+  } while ((pc->threaded || pc->filter_send_frame) &&
+           pc->nb_pending < pc->depth && outputs_wanted(ctx));
+
+  return 0;
+}
+
+static int activate_src(AVFilterContext* ctx) {
+  return activate_shared(ctx, activate_source);
+}
+
+static int config_src_output(AVFilterLink* outlink) {
+  AVFilterContext* ctx = outlink->src;
+  ProxyContext* pc = ctx->priv;
+
+  host_enter(ctx, 1);
+
+  outlink->w = pc->w;
+  outlink->h = pc->h;
+  outlink->sample_aspect_ratio = (AVRational){1, 1};
+  outlink->frame_rate = pc->frame_rate;
+  outlink->time_base = av_inv_q(pc->frame_rate);
+
+  if (pc->transport == TRANSPORT_SHM) {
+    int ret = config_shm(ctx, outlink);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  int ret = warmup(ctx, outlink->format, outlink->w, outlink->h);
+  if (ret < 0) {
+    return ret;
+  }
+
+  ret = fill_desc(pc, outlink->format, outlink->w, outlink->h,
+                  outlink->time_base);
+  if (ret < 0) {
+    return ret;
+  }
+
+  return config_buffers(ctx, outlink->w, outlink->h);
+}
+
+static const AVFilterPad src_outputs[] = {{
+    .name = "default",
+    .type = AVMEDIA_TYPE_VIDEO,
+    .config_props = config_src_output,
+}};
+
+static const AVOption proxysrc_options[] = {
+    {"filter_path",
+     "set the filter path",
+     OFFSET(filter_path),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"config",
+     "set the config",
+     OFFSET(config),
+     AV_OPT_TYPE_STRING,
+     {.str = ""},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"size",
+     "set the frame size",
+     OFFSET(w),
+     AV_OPT_TYPE_IMAGE_SIZE,
+     {.str = "1920x1080"},
+     0,
+     0,
+     FLAGS},
+    {"rate",
+     "set the frame rate",
+     OFFSET(frame_rate),
+     AV_OPT_TYPE_VIDEO_RATE,
+     {.str = "25"},
+     0,
+     INT_MAX,
+     FLAGS},
+    {"duration",
+     "set the duration, or -1 to run until the graph ends",
+     OFFSET(duration),
+     AV_OPT_TYPE_DURATION,
+     {.i64 = -1},
+     -1,
+     INT64_MAX,
+     FLAGS},
+    {"depth",
+     "set the number of frames in flight for asynchronous filters",
+     OFFSET(depth),
+     AV_OPT_TYPE_INT,
+     {.i64 = 2},
+     1,
+     MAX_DEPTH,
+     FLAGS},
+    {"transport",
+     "set how the filter is run",
+     OFFSET(transport),
+     AV_OPT_TYPE_INT,
+     {.i64 = TRANSPORT_DLOPEN},
+     TRANSPORT_DLOPEN,
+     TRANSPORT_SHM,
+     FLAGS,
+     "transport"},
+    {"dlopen",
+     "load the filter into this process",
+     0,
+     AV_OPT_TYPE_CONST,
+     {.i64 = TRANSPORT_DLOPEN},
+     0,
+     0,
+     FLAGS,
+     "transport"},
+    {"shm",
+     "render in another process through shared memory",
+     0,
+     AV_OPT_TYPE_CONST,
+     {.i64 = TRANSPORT_SHM},
+     0,
+     0,
+     FLAGS,
+     "transport"},
+    {"socket",
+     "set the socket path of the renderer process",
+     OFFSET(socket_path),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"slots",
+     "set the number of frame slots in shared memory",
+     OFFSET(nb_slots),
+     AV_OPT_TYPE_INT,
+     {.i64 = 16},
+     2,
+     MAX_SLOTS,
+     FLAGS},
+    {"workers",
+     "set the number of filter instances rendering in parallel",
+     OFFSET(nb_workers),
+     AV_OPT_TYPE_INT,
+     {.i64 = 1},
+     1,
+     MAX_DEPTH,
+     FLAGS},
+    {"share",
+     "share one filter instance between proxies using the same key",
+     OFFSET(share),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"alpha_bbox",
+     "find the bounding box of the rendered pixels",
+     OFFSET(alpha_bbox),
+     AV_OPT_TYPE_BOOL,
+     {.i64 = 0},
+     0,
+     1,
+     FLAGS},
+    {"deadline_ms",
+     "set the time a render may take before the last frame is passed on",
+     OFFSET(deadline_ms),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     FLAGS},
+    {"bind_now",
+     "resolve all symbols of the filter when it's loaded",
+     OFFSET(bind_now),
+     AV_OPT_TYPE_BOOL,
+     {.i64 = 0},
+     0,
+     1,
+     FLAGS},
+    {"warmup",
+     "set the number of throwaway frames rendered before the first one",
+     OFFSET(warmup),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     INT_MAX,
+     FLAGS},
+    {"warmup_size",
+     "set the size of the throwaway frames to warm up in init",
+     OFFSET(warmup_w),
+     AV_OPT_TYPE_IMAGE_SIZE,
+     {.str = NULL},
+     0,
+     0,
+     FLAGS},
+    {"trace_file",
+     "write a trace of every frame's stages to this file",
+     OFFSET(trace_file),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"outputs",
+     "set the sizes of extra outputs scaled down from the render",
+     OFFSET(outputs),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"affinity",
+     "set the CPUs of the proxy's threads, e.g. 0-7|16-23",
+     OFFSET(affinity),
+     AV_OPT_TYPE_STRING,
+     {.str = NULL},
+     CHAR_MIN,
+     CHAR_MAX,
+     FLAGS},
+    {"numa_node",
+     "set the NUMA node of the proxy's threads and frame pool",
+     OFFSET(numa_node),
+     AV_OPT_TYPE_INT,
+     {.i64 = -1},
+     -1,
+     63,
+     FLAGS},
+    {"sched_priority",
+     "set the SCHED_FIFO priority of the proxy's threads",
+     OFFSET(sched_priority),
+     AV_OPT_TYPE_INT,
+     {.i64 = 0},
+     0,
+     99,
+     FLAGS},
+    {NULL},
+};
+
+AVFILTER_DEFINE_CLASS(proxysrc);
+
+const AVFilter ff_vsrc_proxysrc = {
+    .name = "proxysrc",
+    .description = NULL_IF_CONFIG_SMALL("Video source proxy."),
+    .priv_size = sizeof(ProxyContext),
+    .flags = AVFILTER_FLAG_SLICE_THREADS | AVFILTER_FLAG_DYNAMIC_OUTPUTS,
+    .preinit = preinit,
+    .init = init_src,
+    .uninit = uninit,
+    .activate = activate_src,
+    .process_command = process_command,
+    .inputs = NULL,
+    FILTER_OUTPUTS(src_outputs),
+    FILTER_QUERY_FUNC(query_formats),
+    .priv_class = &proxysrc_class,
+};